@@ -152,7 +152,7 @@ private:
 
     private:
         std::array<int16float_t, 4>         hIIR_ { 0 };
-        boost::circular_buffer<samplew_t>   iirb_ { 2, 0 };
+        StateBuffer<samplew_t>              iirb_ { 2, 0 };
     };
 
     class FIR4hrtf
@@ -181,8 +181,8 @@ private:
         }
 
     private:
-        boost::circular_buffer<samplew_t>   delayL_;
-        boost::circular_buffer<samplew_t>   delayR_;
+        StateBuffer<samplew_t>              delayL_;
+        StateBuffer<samplew_t>              delayR_;
         std::array<int16float_t, 4>         head_;
     };
 
@@ -165,7 +165,7 @@ private:
             return true;
         }
 
-        const std::vector<samplew_t> & energy()
+        const StateVector<samplew_t> & energy()
         {
             return energy_;
         };
@@ -310,10 +310,10 @@ private:
         const int power_;
 
         size_t offset = 0;
-        std::vector<samplew_t> complex;
-        std::vector<samplew_t> energy_;
+        StateVector<samplew_t> complex;
+        StateVector<samplew_t> energy_;
 
-        std::vector<int> perm;
+        StateVector<int> perm;
     };
 
     class PsrBiquad
@@ -340,7 +340,7 @@ private:
         }
 
     private:
-        boost::circular_buffer<samplew_t>   delay_ { 4, 0 };
+        StateBuffer<samplew_t>              delay_ { 4, 0 };
         std::array<int16float_t, 6>         coef_ { 0 };
     };
 
@@ -444,7 +444,7 @@ private:
         PsrBiquad bq1;
         PsrBiquad bq2;
 
-        boost::circular_buffer<sample_t>   delay_ { 256, sample_t(0) };
+        StateBuffer<sample_t>              delay_ { 256, sample_t(0) };
         int ix = 0;
     };
 
@@ -11,10 +11,12 @@ template<typename sampleType, typename wideSampleType>
 class DNSE_BE : public Filter<sampleType, wideSampleType>
 {
     using Filter<sampleType, wideSampleType>::smulw;
+    using Filter<sampleType, wideSampleType>::smuls;
     using Filter<sampleType, wideSampleType>::normalize;
 public:
     using sample_t = typename Filter<sampleType, wideSampleType>::sample_t;
     using samplew_t = typename Filter<sampleType, wideSampleType>::samplew_t;
+    using samples_t = typename Filter<sampleType, wideSampleType>::samples_t;
     using int16float_t = typename Filter<sampleType, wideSampleType>::int16float_t;
 
 
@@ -273,14 +275,14 @@ private:
 
         samplew_t filter(sample_t in)
         {
-            auto nxt = smulw(iirb_[1], hIIR_[4]) + smulw(iirb_[0], hIIR_[3]) + in;
-            auto out = smulw(4 * (smulw(iirb_[1], hIIR_[2]) + smulw(iirb_[0], hIIR_[1]) + nxt), hIIR_[0]);
+            auto nxt = smuls(iirb_[1], hIIR_[4]) + smuls(iirb_[0], hIIR_[3]) + in;
+            auto out = smuls(4 * (smuls(iirb_[1], hIIR_[2]) + smuls(iirb_[0], hIIR_[1]) + nxt), hIIR_[0]);
             iirb_.push_front(8 * nxt);
-            return out;
+            return samplew_t(out);
         }
 
     private:
-        boost::circular_buffer<samplew_t>   iirb_ { 2, 0 };
+        StateBuffer<samples_t>              iirb_ { 2, 0 };
         std::array<int16float_t, 5>         hIIR_ { 0 };
     };
 
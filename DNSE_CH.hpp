@@ -202,7 +202,7 @@ private:
         std::array<intfloat_t, 4> gains_ { 0 };
 
         sample_t v_tone = 0;
-        boost::circular_buffer<samplew_t> delay_ { 2, 0 };
+        StateBuffer<samplew_t> delay_ { 2, 0 };
     };
 
     class DelayFilter
@@ -218,7 +218,8 @@ private:
 
     protected:
         int delay_ = 0;
-        boost::circular_buffer<samplew_t> delay_buff_;
+        // in the wide type: the network runs past the sample range on hot material and the taps are not clipped
+        StateBuffer<samplew_t> delay_buff_;
     };
 
     class DelaySplitFilter : public DelayFilter
@@ -315,7 +316,7 @@ private:
         }
 
     private:
-        std::vector<APFilter> chain_;
+        StateVector<APFilter> chain_;
     };
 
     class VbrFilter : public DelayFilter
@@ -4,6 +4,7 @@
 #include <array>
 
 #include "filter.h"
+#include "cpuFeatures.h"
 
 
 template<typename sampleType, typename wideSampleType>
@@ -14,10 +15,12 @@ class DNSE_EQ : public Filter<sampleType, wideSampleType>
                                         0x3E8, 0x849, 0xD34, 0x12B7, 0x18E8, 0x1FD9, 0x27A4, 0x3061, 0x3A30, 0x4531, 0x518A, 0x5F65 };
 
     using Filter<sampleType, wideSampleType>::smulw;
+    using Filter<sampleType, wideSampleType>::smuls;
     using Filter<sampleType, wideSampleType>::normalize;
 public:
     using sample_t = typename Filter<sampleType, wideSampleType>::sample_t;
     using samplew_t = typename Filter<sampleType, wideSampleType>::samplew_t;
+    using samples_t = typename Filter<sampleType, wideSampleType>::samples_t;
     using int16float_t = typename Filter<sampleType, wideSampleType>::int16float_t;
 
 
@@ -87,9 +90,146 @@ public:
         *r_out = sample_t(rb);
     }
 
+    using Lane = typename Filter<sampleType, wideSampleType>::Lane;
+
+    // The 14 biquads of every stream advance together, lane k of the state arrays belongs to lanes[k]
+    void filterLanes(Lane * lanes, int nLanes, int nSamples) override
+    {
+        if (nLanes <= 1 || nLanes > Filter<sampleType, wideSampleType>::MaxLanes)
+        {
+            Filter<sampleType, wideSampleType>::filterLanes(lanes, nLanes, nSamples);
+        }
+        else if (nLanes <= 4)
+        {
+            filterLanes<4>(lanes, nLanes, nSamples);
+        }
+        else
+        {
+            filterLanes<Filter<sampleType, wideSampleType>::MaxLanes>(lanes, nLanes, nSamples);
+        }
+    }
+    bool hasLaneKernel() const override
+    {
+        return true;
+    }
+
 private:
+    // the lanes of the 64-bit state fill whole registers only from AVX2 on, so that is where the variants pay off
+    template<int Lanes>
+    void filterLanes(Lane * lanes, int nLanes, int nSamples)
+    {
+#if defined(CPU_DISPATCH)
+        switch (simdLevel())
+        {
+        case SimdLevel::AVX512:
+            return filterLanesAvx512<Lanes>(lanes, nLanes, nSamples);
+        case SimdLevel::AVX2:
+            return filterLanesAvx2<Lanes>(lanes, nLanes, nSamples);
+        default:
+            break;
+        }
+#endif
+        lanesKernel<Lanes>(lanes, nLanes, nSamples);
+    }
+
+#if defined(CPU_DISPATCH)
+    template<int Lanes>
+    TARGET_AVX2 void filterLanesAvx2(Lane * lanes, int nLanes, int nSamples)
+    {
+        lanesKernel<Lanes>(lanes, nLanes, nSamples);
+    }
+
+    template<int Lanes>
+    TARGET_AVX512 void filterLanesAvx512(Lane * lanes, int nLanes, int nSamples)
+    {
+        lanesKernel<Lanes>(lanes, nLanes, nSamples);
+    }
+#endif
+
+    template<int Lanes>
+    DISPATCH_INLINE void lanesKernel(Lane * lanes, int nLanes, int nSamples)
+    {
+        constexpr int Bands = 7;
+
+        // state[band][channel][lane], unused lanes stay zero
+        alignas(64) samples_t z0[Bands][2][Lanes] = {};
+        alignas(64) samples_t z1[Bands][2][Lanes] = {};
+        alignas(64) int16float_t fc[Bands][3][Lanes] = {};
+        for (int k = 0; k < nLanes; k++)
+        {
+            auto * eq = static_cast<DNSE_EQ *>(lanes[k].filter);
+            for (int b = 0; b < Bands; b++)
+            {
+                const BiQuadFilter * bq[2] = { eq->bands(b, 0), eq->bands(b, 1) };
+                for (int c = 0; c < 2; c++)
+                {
+                    z0[b][c][k] = bq[c]->delay_[0];
+                    z1[b][c][k] = bq[c]->delay_[1];
+                }
+                for (int j = 0; j < 3; j++)
+                {
+                    fc[b][j][k] = bq[0]->fc_[j];
+                }
+            }
+        }
+
+        for (int i = 0; i < nSamples; i++)
+        {
+            alignas(64) sample_t in[2][Lanes] = {};
+            for (int k = 0; k < nLanes; k++)
+            {
+                in[0][k] = lanes[k].lb[i * lanes[k].step];
+                in[1][k] = lanes[k].rb[i * lanes[k].step];
+            }
+
+            // bq6 + bq5 + ... + bq0 + in, in the order of the single stream filter
+            alignas(64) samplew_t acc[2][Lanes];
+            for (int b = Bands - 1; b >= 0; b--)
+            {
+                for (int c = 0; c < 2; c++)
+                {
+                    for (int k = 0; k < Lanes; k++)
+                    {
+                        auto v0 = z0[b][c][k];
+                        samples_t x = 4 * (smuls(v0, fc[b][1][k]) + smuls(z1[b][c][k], fc[b][2][k]) + in[c][k]);
+                        samplew_t out = samplew_t(smuls(x - v0, fc[b][0][k]));
+                        z0[b][c][k] = z1[b][c][k];
+                        z1[b][c][k] = x;
+                        acc[c][k] = b == Bands - 1 ? out : acc[c][k] + out;
+                    }
+                }
+            }
+
+            for (int k = 0; k < nLanes; k++)
+            {
+                samplew_t lb = acc[0][k] + in[0][k];
+                samplew_t rb = acc[1][k] + in[1][k];
+
+                static_cast<DNSE_EQ *>(lanes[k].filter)->normalize(lb, rb);
+
+                lanes[k].lb[i * lanes[k].step] = sample_t(lb);
+                lanes[k].rb[i * lanes[k].step] = sample_t(rb);
+            }
+        }
+
+        for (int k = 0; k < nLanes; k++)
+        {
+            auto * eq = static_cast<DNSE_EQ *>(lanes[k].filter);
+            for (int b = 0; b < Bands; b++)
+            {
+                for (int c = 0; c < 2; c++)
+                {
+                    auto * bq = eq->bands(b, c);
+                    bq->delay_[0] = z0[b][c][k];
+                    bq->delay_[1] = z1[b][c][k];
+                }
+            }
+        }
+    }
+
     class BiQuadFilter
     {
+        friend class DNSE_EQ;
     public:
         BiQuadFilter() = default;
         BiQuadFilter(const std::array<int16_t, 3> & filterCoeff, int16float_t gain)
@@ -110,13 +250,13 @@ private:
         {
             auto v0 = delay_[0];
             auto v1 = delay_[1];
-            delay_.push_back(4 * (smulw(v0, fc_[1]) + smulw(v1, fc_[2]) + in));
-            return smulw(delay_[1] - v0, fc_[0]);
+            delay_.push_back(4 * (smuls(v0, fc_[1]) + smuls(v1, fc_[2]) + in));
+            return samplew_t(smuls(delay_[1] - v0, fc_[0]));
         }
 
     private:
         std::array<int16float_t, 3>         fc_ { 0 };
-        boost::circular_buffer<samplew_t>   delay_ { 2, 0 };
+        StateBuffer<samples_t>              delay_ { 2, 0 };
     };
 
     BiQuadFilter    bq0l_, bq0r_;
@@ -128,4 +268,11 @@ private:
     BiQuadFilter    bq6l_, bq6r_;
 
     std::array<short, 7>    gains_;
+
+    BiQuadFilter * bands(int band, int channel)
+    {
+        BiQuadFilter * all[7][2] = { { &bq0l_, &bq0r_ }, { &bq1l_, &bq1r_ }, { &bq2l_, &bq2r_ }, { &bq3l_, &bq3r_ },
+                                     { &bq4l_, &bq4r_ }, { &bq5l_, &bq5r_ }, { &bq6l_, &bq6r_ } };
+        return all[band][channel];
+    }
 };
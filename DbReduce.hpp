@@ -42,6 +42,12 @@ public:
         *r_out = sample_t(smulw(r, gain_));
     }
 
+    // a gain and no state, one lane after another costs no more than one file at a time
+    bool hasLaneKernel() const override
+    {
+        return true;
+    }
+
 private:
     intfloat_t gain_ = 0;
 };
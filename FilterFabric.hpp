@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <map>
+#include <algorithm>
 
 #include <boost/algorithm/string.hpp>
 #include "filter.h"
@@ -32,6 +33,29 @@ public:
         : doDbReduce_(doDbReduce), silence_(silence)
     {}
     int getSilence() const noexcept { return silence_; }  // inline + const 
+    // float sources get Filter<float, float> chains instead of Filter<float, double>
+    void setSinglePrecision(bool single) noexcept { singlePrecision_ = single; }
+    bool singlePrecision() const noexcept { return singlePrecision_; }
+    // 16-bit integer sources get Filter<int16_t, int32_t> chains instead of Filter<int32_t, int64_t>. Off by
+    //  default: the 16-bit fixed point truncates on its shifts and writes 16 bits, the 32-bit chain neither
+    void setInt16Chain(bool int16) noexcept { int16Chain_ = int16; }
+    bool int16Chain() const noexcept { return int16Chain_; }
+    // Everything that makes the output of the chains, the same description gives the same output
+    std::wstring description() const
+    {
+        return stringJoin(descs_, L";")
+            + L";silence=" + std::to_wstring(silence_)
+            + L";dbreduce=" + (doDbReduce_ ? L"1" : L"0")
+            + L";single=" + (singlePrecision_ ? L"1" : L"0")
+            + L";int16=" + (int16Chain_ ? L"1" : L"0");
+    }
+    // Whether every filter of the chain advances the files of --lanes side by side. The lockstep only pays
+    //  off then, one filter without a kernel runs the lanes one after another while the other workers wait
+    bool hasLaneKernels() const
+    {
+        auto chain = create<float, double>();
+        return !chain.empty() && std::all_of(chain.begin(), chain.end(), [] (const auto & filter) { return filter->hasLaneKernel(); });
+    }
     bool addDesc(std::wstring desc)
     {
         static const std::map<std::wstring, std::wstring> aliases = {
@@ -185,5 +209,7 @@ private:
 
     bool doDbReduce_;
     int silence_;
+    bool singlePrecision_ = false;
+    bool int16Chain_ = false;
     std::vector<std::wstring> descs_;
 };
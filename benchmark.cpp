@@ -0,0 +1,586 @@
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include <iomanip>
+#include <sstream>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <cstring>
+
+#include "denormals.h"
+#include "sampleConvert.h"
+#include "benchmark.h"
+
+
+namespace
+{
+
+// half scale white noise of the sample type
+template<typename sample_t>
+sample_t noiseSample(uint32_t & seed)
+{
+    seed = seed * 1664525u + 1013904223u;
+    if constexpr (std::is_floating_point_v<sample_t>)
+    {
+        return sample_t(int32_t(seed) / 4294967296.);
+    }
+    else
+    {
+        return sample_t(int32_t(seed) >> (33 - 8 * sizeof(sample_t)));
+    }
+}
+
+// the same every run for the same seed. The channels differ, CH filters only what they have in common
+template<typename sample_t>
+void fillNoise(std::vector<sample_t> & l, std::vector<sample_t> & r, size_t count, uint32_t seed = 1)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        l[i] = noiseSample<sample_t>(seed);
+        r[i] = noiseSample<sample_t>(seed);
+    }
+}
+
+// a chain of the type over the samples in place, returns the seconds it took
+template<typename sample_t, typename samplew_t>
+double runChain(const FilterFabric & fab, int sampleRate, std::vector<sample_t> & l, std::vector<sample_t> & r, int block)
+{
+    auto chain = fab.create<sample_t, samplew_t>();
+    for (auto & filter : chain)
+    {
+        filter->setSamplerate(sampleRate);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t offset = 0; offset < l.size(); offset += block)
+    {
+        const int count = int(std::min<size_t>(block, l.size() - offset));
+        for (auto & filter : chain)
+        {
+            filter->filter(&l[offset], &r[offset], &l[offset], &r[offset], count);
+        }
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// one chain per file in lockstep, each filter over all the files at once as LaneScheduler runs them.
+// The files are of the same length, returns the seconds it took
+template<typename sample_t, typename samplew_t>
+double runLanes(const FilterFabric & fab, int sampleRate, std::vector<std::vector<sample_t>> & l, std::vector<std::vector<sample_t>> & r, int block)
+{
+    using Lane = typename Filter<sample_t, samplew_t>::Lane;
+
+    const int nLanes = int(l.size());
+    std::vector<std::vector<std::unique_ptr<Filter<sample_t, samplew_t>>>> chains;
+    for (int k = 0; k < nLanes; k++)
+    {
+        chains.push_back(fab.create<sample_t, samplew_t>());
+        for (auto & filter : chains.back())
+        {
+            filter->setSamplerate(sampleRate);
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t offset = 0; offset < l[0].size(); offset += block)
+    {
+        const int count = int(std::min<size_t>(block, l[0].size() - offset));
+        for (size_t j = 0; j < chains[0].size(); j++)
+        {
+            Lane lanes[Filter<sample_t, samplew_t>::MaxLanes];
+            for (int k = 0; k < nLanes; k++)
+            {
+                lanes[k] = Lane { chains[k][j].get(), &l[k][offset], &r[k][offset], 1 };
+            }
+            chains[0][j]->filterLanes(lanes, nLanes, count);
+        }
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// a chain over the samples in place with what the denormal mode does to it, as MediaInput::decode and dsp do
+template<typename sample_t, typename samplew_t>
+void runChainIn(DenormalMode mode, const FilterFabric & fab, int sampleRate, std::vector<sample_t> & l, std::vector<sample_t> & r, int block)
+{
+    auto chain = fab.create<sample_t, samplew_t>();
+    for (auto & filter : chain)
+    {
+        filter->setSamplerate(sampleRate);
+    }
+
+    for (size_t offset = 0; offset < l.size(); offset += block)
+    {
+        const int count = int(std::min<size_t>(block, l.size() - offset));
+        if (mode == DenormalMode::Noise)
+        {
+            addDenormalNoise(&l[offset], &r[offset], count, 1, int64_t(offset));
+        }
+
+        ScopedFlushDenormals ftz(mode == DenormalMode::Flush);
+        for (auto & filter : chain)
+        {
+            filter->filter(&l[offset], &r[offset], &l[offset], &r[offset], count);
+        }
+    }
+}
+
+// the sample at i of a buffer in the layout, the right channel follows the left one in the packed layouts
+template<typename T>
+T & sampleAt(std::vector<uint8_t> * planes, bool planar, int channel, size_t i)
+{
+    return planar ? ((T *)planes[channel].data())[i] : ((T *)planes[0].data())[2 * i + channel];
+}
+
+// noise over the whole range of the kind, with the extremes and, for float, the values out of range
+void fillLayout(SampleLayout layout, std::vector<uint8_t> * planes, size_t count, uint32_t & seed)
+{
+    static const float specials[] = { 1.f, -1.f, 0.99999994f, -1.00000012f, 2.f, -2.f, 1e9f, -1e9f, 1e-40f, 0.f };
+
+    for (size_t i = 0; i < count; i++)
+    {
+        for (int channel = 0; channel < 2; channel++)
+        {
+            seed = seed * 1664525u + 1013904223u;
+            switch (layout.kind)
+            {
+            case SampleKind::S16:
+                sampleAt<int16_t>(planes, layout.planar, channel, i) = int16_t(seed >> 16);
+                break;
+            case SampleKind::S32:
+                sampleAt<int32_t>(planes, layout.planar, channel, i) = (seed & 0xf00) == 0 ? (seed & 1 ? INT32_MAX : INT32_MIN) : int32_t(seed);
+                break;
+            case SampleKind::FLT:
+                sampleAt<float>(planes, layout.planar, channel, i) = (seed & 0xf00) == 0 ? specials[(seed >> 12) % std::size(specials)]
+                                                                                         : float(int32_t(seed) / 1717986918.4);
+                break;
+            }
+        }
+    }
+}
+
+std::string layoutName(SampleLayout layout)
+{
+    const char * kinds[] = { "s16", "s32", "flt" };
+    return std::string(kinds[int(layout.kind)]) + (layout.planar ? "p" : "");
+}
+
+// findConvertKernel against the scalar conversions, over the lengths around the vector widths. The output
+// buffers are compared whole, so that writing past the samples counts as a mismatch as well
+int checkConverters()
+{
+    int failed = 0;
+    const SimdLevel selected = simdLevel();
+
+    std::vector<int> counts;
+    for (int count = 0; count <= 70; count++)
+    {
+        counts.push_back(count);
+    }
+    counts.push_back(4096 + 13);
+
+    std::vector<SampleLayout> layouts;
+    for (auto kind : { SampleKind::S16, SampleKind::S32, SampleKind::FLT })
+    {
+        layouts.push_back({ kind, false });
+        layouts.push_back({ kind, true });
+    }
+
+    for (auto level : { SimdLevel::SSE2, SimdLevel::AVX2, SimdLevel::AVX512 })
+    {
+        if (level > detectSimdLevel())
+        {
+            break;
+        }
+        setSimdLevel(level);
+
+        int kernels = 0;
+        uint32_t seed = 1;
+        for (auto in : layouts)
+        {
+            for (auto out : layouts)
+            {
+                const ConvertKernel kernel = findConvertKernel(in, out);
+                const ConvertKernel reference = sample_convert::scalarFor(in, out);
+                if (kernel == nullptr || kernel == reference)
+                {
+                    continue;
+                }
+                kernels++;
+
+                for (int count : counts)
+                {
+                    const size_t bytes = size_t(count) * 2 * sizeof(float);
+                    std::vector<uint8_t> input[2] = { std::vector<uint8_t>(bytes), std::vector<uint8_t>(bytes) };
+                    std::vector<uint8_t> expected[2] = { std::vector<uint8_t>(bytes + 64, 0xa5), std::vector<uint8_t>(bytes + 64, 0xa5) };
+                    std::vector<uint8_t> result[2] = { expected[0], expected[1] };
+                    fillLayout(in, input, count, seed);
+
+                    const uint8_t * inPlanes[2] = { input[0].data(), input[1].data() };
+                    uint8_t * expectedPlanes[2] = { expected[0].data(), expected[1].data() };
+                    uint8_t * resultPlanes[2] = { result[0].data(), result[1].data() };
+                    reference(inPlanes, expectedPlanes, count);
+                    kernel(inPlanes, resultPlanes, count);
+
+                    if (result[0] != expected[0] || result[1] != expected[1])
+                    {
+                        err() << "FAILED: " << simdLevelName(level) << " " << layoutName(in) << " to " << layoutName(out)
+                              << " differs from the scalar conversion over " << count << " samples";
+                        failed++;
+                        break;
+                    }
+                }
+            }
+        }
+        msg() << "sample conversions, " << std::left << std::setw(7) << simdLevelName(level) << kernels << " kernels";
+    }
+
+    setSimdLevel(selected);
+    return failed;
+}
+
+// The lane kernels against the chains run file by file, over several lane counts, at each SIMD level
+template<typename sample_t, typename samplew_t>
+int checkLanes(const FilterFabric & fab, int sampleRate, const char * name)
+{
+    int failed = 0;
+    const SimdLevel selected = simdLevel();
+    const size_t count = size_t(sampleRate) * 2 + 77;
+
+    for (auto level : { SimdLevel::SSE2, SimdLevel::AVX2, SimdLevel::AVX512 })
+    {
+        if (level > detectSimdLevel())
+        {
+            break;
+        }
+        setSimdLevel(level);
+
+        for (int nLanes : { 2, 3, 4, 5, 8 })
+        {
+            std::vector<std::vector<sample_t>> l(nLanes, std::vector<sample_t>(count)), r = l;
+            for (int k = 0; k < nLanes; k++)
+            {
+                fillNoise(l[k], r[k], count, uint32_t(k + 1));
+            }
+            auto lExpected = l, rExpected = r;
+            for (int k = 0; k < nLanes; k++)
+            {
+                runChain<sample_t, samplew_t>(fab, sampleRate, lExpected[k], rExpected[k], 1000);
+            }
+            runLanes<sample_t, samplew_t>(fab, sampleRate, l, r, 1000);
+
+            if (l != lExpected || r != rExpected)
+            {
+                err() << "FAILED: " << simdLevelName(level) << " " << name << " " << nLanes << " lanes differ from the files filtered one by one";
+                failed++;
+            }
+        }
+        msg() << name << " lanes, " << std::left << std::setw(7) << simdLevelName(level) << "2 to 8 lanes";
+    }
+
+    setSimdLevel(selected);
+    return failed;
+}
+
+// The chain over noise and a silent tail in each denormal mode against the chain left alone: the 32-bit
+// output is to stay the same, the float output is not to be subnormal with ftz and noise, and the noise
+// is not to depend on the block size
+template<typename sample_t, typename samplew_t>
+int checkDenormals(const FilterFabric & fab, int sampleRate, const char * name)
+{
+    int failed = 0;
+    const size_t music = size_t(sampleRate);
+    const size_t total = music + size_t(sampleRate) * 20;
+
+    std::vector<sample_t> l(total, 0), r(total, 0);
+    fillNoise(l, r, music);
+    auto lOff = l, rOff = r;
+    runChainIn<sample_t, samplew_t>(DenormalMode::Off, fab, sampleRate, lOff, rOff, 1024);
+
+    for (auto mode : { DenormalMode::Flush, DenormalMode::Noise })
+    {
+        auto lMode = l, rMode = r;
+        runChainIn<sample_t, samplew_t>(mode, fab, sampleRate, lMode, rMode, 1024);
+
+        size_t changed = 0, subnormal = 0;
+        for (size_t i = 0; i < total; i++)
+        {
+            for (auto [off, v] : { std::make_pair(lOff[i], lMode[i]), std::make_pair(rOff[i], rMode[i]) })
+            {
+                changed += sample_convert::convert<int32_t>(float(off)) != sample_convert::convert<int32_t>(float(v));
+                subnormal += std::fpclassify(v) == FP_SUBNORMAL;
+            }
+        }
+        if (changed > 0 || subnormal > 0)
+        {
+            err() << "FAILED: " << name << " with --denormals " << denormalModeName(mode) << ", " << changed
+                  << " samples of the 32-bit output changed, " << subnormal << " samples are subnormal";
+            failed++;
+        }
+
+        if (mode == DenormalMode::Noise)
+        {
+            auto lBlocks = l, rBlocks = r;
+            runChainIn<sample_t, samplew_t>(mode, fab, sampleRate, lBlocks, rBlocks, 333);
+            if (lBlocks != lMode || rBlocks != rMode)
+            {
+                err() << "FAILED: " << name << " with --denormals noise depends on the block size";
+                failed++;
+            }
+        }
+    }
+    msg() << name << " denormal modes";
+
+    return failed;
+}
+
+// The 16-bit chain against the 32-bit one over the same 16-bit input, for each preset. The 16-bit fixed point
+// truncates on its shifts, so they are not the same: the bounds are a little above the DC offset (-25 LSB
+// with BE) and the deviation (51 LSB with dance) measured when the check was added
+int checkInt16(int sampleRate)
+{
+    const double MaxOffset = 32;
+    const int MaxDeviation = 64;
+
+    int failed = 0;
+    const size_t music = size_t(sampleRate) * 3;
+    const size_t total = music + size_t(sampleRate) * 2;
+
+    std::vector<int16_t> l(total, 0), r(total, 0);
+    fillNoise(l, r, music);
+
+    for (auto preset : { "studio", "rock", "classical", "jazz", "dance", "ballad", "club", "rnb",
+                         "cafe", "concert", "livecafe", "cathedral", "upscaling" })
+    {
+        FilterFabric fab;
+        fab.addDesc(std::wstring(preset, preset + std::strlen(preset)));
+
+        // as a 16-bit source goes through the 32-bit chain and back
+        std::vector<int32_t> lWide(total), rWide(total);
+        std::transform(l.begin(), l.end(), lWide.begin(), sample_convert::convert<int32_t, int16_t>);
+        std::transform(r.begin(), r.end(), rWide.begin(), sample_convert::convert<int32_t, int16_t>);
+        runChain<int32_t, int64_t>(fab, sampleRate, lWide, rWide, 1024);
+        auto lNarrow = l, rNarrow = r;
+        runChain<int16_t, int32_t>(fab, sampleRate, lNarrow, rNarrow, 1024);
+
+        double offset = 0;
+        int deviation = 0;
+        for (size_t i = 0; i < total; i++)
+        {
+            for (auto [wide, narrow] : { std::make_pair(lWide[i], lNarrow[i]), std::make_pair(rWide[i], rNarrow[i]) })
+            {
+                const int d = narrow - sample_convert::convert<int16_t>(wide);
+                offset += d;
+                deviation = std::max(deviation, std::abs(d));
+            }
+        }
+        offset /= 2 * total;
+
+        std::ostringstream s;
+        s << std::fixed << std::setprecision(1) << "int16 chain, " << std::left << std::setw(10) << preset
+          << "offset " << offset << " LSB, at most " << deviation << " LSB";
+        if (std::abs(offset) > MaxOffset || deviation > MaxDeviation)
+        {
+            err() << "FAILED: " << s.str() << " from the 32-bit chain";
+            failed++;
+        }
+        else
+        {
+            msg() << s.str();
+        }
+    }
+
+    return failed;
+}
+
+// seconds of input filtered per second
+std::string realtime(double audioSeconds, double seconds)
+{
+    std::ostringstream s;
+    s << std::fixed << std::setprecision(1) << audioSeconds / seconds << "x";
+    return s.str();
+}
+
+} // namespace
+
+
+int benchmarkDenormals(const FilterFabric & fab, int sampleRate)
+{
+    const int block = 1024;
+    const int musicSeconds = 10;
+    // the appended silence is what this is about, a tail of some length is measured without it as well
+    const int tailSeconds = fab.getSilence() > 0 ? fab.getSilence() : 30;
+    const size_t music = size_t(musicSeconds) * sampleRate;
+    const size_t total = music + size_t(tailSeconds) * sampleRate;
+
+    msg() << "Float chain at " << sampleRate << " Hz, " << musicSeconds << " s of noise then " << tailSeconds << " s of silence";
+
+    for (auto mode : { DenormalMode::Off, DenormalMode::Flush, DenormalMode::Noise })
+    {
+        auto chain = fab.create<float, double>();
+        for (auto & filter : chain)
+        {
+            filter->setSamplerate(sampleRate);
+        }
+
+        std::vector<float> l(total, 0.f), r(total, 0.f);
+        fillNoise(l, r, music);
+
+        // as MediaInput::decode and dsp do it, block by block
+        double seconds[2] = {};
+        for (int part = 0; part < 2; part++)
+        {
+            const size_t first = part == 0 ? 0 : music;
+            const size_t last = part == 0 ? music : total;
+
+            auto start = std::chrono::steady_clock::now();
+            for (size_t offset = first; offset < last; offset += block)
+            {
+                const int count = int(std::min<size_t>(block, last - offset));
+                if (mode == DenormalMode::Noise)
+                {
+                    addDenormalNoise(&l[offset], &r[offset], count, 1, int64_t(offset));
+                }
+
+                ScopedFlushDenormals ftz(mode == DenormalMode::Flush);
+                for (auto & filter : chain)
+                {
+                    filter->filter(&l[offset], &r[offset], &l[offset], &r[offset], count);
+                }
+            }
+            seconds[part] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        msg() << std::left << std::setw(8) << denormalModeName(mode)
+              << "music " << std::setw(10) << realtime(musicSeconds, seconds[0])
+              << "tail " << realtime(tailSeconds, seconds[1]);
+    }
+
+    return 0;
+}
+
+
+int benchmarkPrecision(const FilterFabric & fab, int sampleRate)
+{
+    const int seconds = 30;
+    const size_t count = size_t(seconds) * sampleRate;
+
+    // noise over a 20 Hz - 10 kHz sweep, so that every band of the filters gets something
+    const double pi = 3.14159265358979323846;
+    std::vector<float> l(count), r(count);
+    fillNoise(l, r, count);
+    for (size_t i = 0; i < count; i++)
+    {
+        const double t = double(i) / sampleRate;
+        const float sweep = float(0.4 * std::sin(2 * pi * (20 * t + 10000 * t * t / (2 * seconds))));
+        l[i] = l[i] / 4 + sweep;
+        r[i] = r[i] / 4 + sweep * 0.8f;
+    }
+
+    auto lSingle = l, rSingle = r;
+    const double doubleSeconds = runChain<float, double>(fab, sampleRate, l, r, 1024);
+    const double singleSeconds = runChain<float, float>(fab, sampleRate, lSingle, rSingle, 1024);
+
+    double maxError = 0, errorPower = 0, signalPower = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        for (auto [ref, v] : { std::make_pair(l[i], lSingle[i]), std::make_pair(r[i], rSingle[i]) })
+        {
+            const double e = double(v) - ref;
+            maxError = std::max(maxError, std::abs(e));
+            errorPower += e * e;
+            signalPower += double(ref) * ref;
+        }
+    }
+
+    const auto dB = [] (double ratio) { return ratio > 0 ? 10 * std::log10(ratio) : -std::numeric_limits<double>::infinity(); };
+
+    msg() << "Float chain at " << sampleRate << " Hz over " << seconds << " s of noise and a sweep, single against double precision";
+    msg() << std::fixed << std::setprecision(1)
+          << "max error " << 2 * dB(maxError) << " dBFS, signal to error " << dB(signalPower / errorPower) << " dB";
+    msg() << "double  " << realtime(seconds, doubleSeconds);
+    msg() << "single  " << realtime(seconds, singleSeconds);
+
+    return 0;
+}
+
+
+int selfCheck(const FilterFabric & fab, int sampleRate)
+{
+    int failed = 0;
+    failed += checkConverters();
+
+    // the EQ of the club preset, the gains far from flat
+    FilterFabric eq;
+    eq.addDesc(L"eq,19,17,9,7,15,19,18");
+    failed += checkLanes<float, double>(eq, sampleRate, "EQ float");
+    failed += checkLanes<float, float>(eq, sampleRate, "EQ single");
+    failed += checkLanes<int32_t, int64_t>(eq, sampleRate, "EQ int32");
+    failed += checkLanes<int16_t, int32_t>(eq, sampleRate, "EQ int16");
+
+    failed += checkDenormals<float, double>(fab, sampleRate, "float chain");
+    failed += checkDenormals<float, float>(fab, sampleRate, "single chain");
+
+    failed += checkInt16(sampleRate);
+
+    if (failed > 0)
+    {
+        err() << failed << " self-check(s) failed";
+        return 1;
+    }
+    msg() << "All self-checks passed";
+    return 0;
+}
+
+
+int benchmarkLanes(const FilterFabric & fab, int sampleRate)
+{
+    const int seconds = 10;
+    const size_t count = size_t(seconds) * sampleRate;
+    const int maxLanes = Filter<float, double>::MaxLanes;
+
+    const auto measure = [&] (auto sample, auto sampleWide, const char * name)
+    {
+        using sample_t = decltype(sample);
+        using samplew_t = decltype(sampleWide);
+
+        std::vector<std::vector<sample_t>> l(maxLanes, std::vector<sample_t>(count)), r = l;
+        for (int k = 0; k < maxLanes; k++)
+        {
+            fillNoise(l[k], r[k], count, uint32_t(k + 1));
+        }
+
+        msg() << name << " chain at " << sampleRate << " Hz, " << seconds << " s of noise per file, on one thread";
+
+        double sequential = 0;
+        for (int k = 0; k < maxLanes; k++)
+        {
+            auto lFile = l[k], rFile = r[k];
+            sequential += runChain<sample_t, samplew_t>(fab, sampleRate, lFile, rFile, 1024);
+        }
+        msg() << std::left << std::setw(14) << "file by file" << realtime(maxLanes * seconds, sequential);
+
+        for (int nLanes : { 4, maxLanes })
+        {
+            std::vector<std::vector<sample_t>> lLanes(l.begin(), l.begin() + nLanes), rLanes(r.begin(), r.begin() + nLanes);
+            const double lockstep = runLanes<sample_t, samplew_t>(fab, sampleRate, lLanes, rLanes, 1024);
+            // the other workers of the group wait while one filters, the lockstep wins once it is faster
+            //  than the files filtered on that many threads
+            msg() << std::left << std::setw(14) << (std::to_string(nLanes) + " lanes") << std::setw(10) << realtime(nLanes * seconds, lockstep)
+                  << "against " << realtime(nLanes * seconds, sequential / maxLanes) << " on " << nLanes << " threads";
+        }
+    };
+
+    measure(float(), double(), "Float");
+    measure(int32_t(), int64_t(), "32-bit integer");
+    if (fab.int16Chain())
+    {
+        measure(int16_t(), int32_t(), "16-bit integer");
+    }
+
+    if (!fab.hasLaneKernels())
+    {
+        msg() << "Not every filter of the chain has a lane kernel, --lanes is off for it";
+    }
+    return 0;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "log.hpp"
+#include "FilterFabric.hpp"
+
+
+// Offline measurements of the filter chain on synthetic input, no media files involved.
+// They report with msg() and return the process exit code
+
+// Throughput of the float chain over music and over the silent tail after it, once per denormal mode
+int benchmarkDenormals(const FilterFabric & fab, int sampleRate = 44100);
+
+// Error of the single precision float chain against the double one, and the throughput of both
+int benchmarkPrecision(const FilterFabric & fab, int sampleRate = 44100);
+
+// Throughput of the chain over several files in lockstep with the lane kernels, and file by file
+int benchmarkLanes(const FilterFabric & fab, int sampleRate = 44100);
+
+// The vectorized code paths against the plain ones they stand for, at each SIMD level the processor has,
+// the denormal modes of the chain against each other and the 16-bit chain against the 32-bit one.
+// A mismatch is reported with err() and makes the exit code 1
+int selfCheck(const FilterFabric & fab, int sampleRate = 44100);
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <vector>
+#include <mutex>
+#include <utility>
+#include <algorithm>
+
+
+// A 64-byte aligned chunk of memory
+class AlignedBuffer
+{
+    AlignedBuffer(const AlignedBuffer &) = delete;
+    AlignedBuffer operator=(const AlignedBuffer &) = delete;
+public:
+    static constexpr size_t Alignment = 64;
+
+    AlignedBuffer() = default;
+    explicit AlignedBuffer(size_t capacity)
+        : data_((uint8_t *)::operator new(roundUp(capacity), std::align_val_t(Alignment)))
+        , capacity_(roundUp(capacity))
+    {}
+    AlignedBuffer(AlignedBuffer && other) noexcept
+    {
+        *this = std::move(other);
+    }
+    AlignedBuffer & operator=(AlignedBuffer && other) noexcept
+    {
+        std::swap(data_, other.data_);
+        std::swap(capacity_, other.capacity_);
+        return *this;
+    }
+    ~AlignedBuffer()
+    {
+        if (data_)
+        {
+            ::operator delete(data_, std::align_val_t(Alignment));
+        }
+    }
+
+    uint8_t * data() const { return data_; }
+    size_t capacity() const { return capacity_; }
+
+    static size_t roundUp(size_t bytes)
+    {
+        return (bytes + Alignment - 1) / Alignment * Alignment;
+    }
+
+private:
+    uint8_t *   data_ = nullptr;
+    size_t      capacity_ = 0;
+};
+
+
+// The sample buffers of a worker thread. Released buffers are handed out again to the next blocks and files,
+// new ones are made as large as the largest request seen so that they stop growing after the first frames
+class BufferArena
+{
+    BufferArena(const BufferArena &) = delete;
+    BufferArena operator=(const BufferArena &) = delete;
+public:
+    BufferArena() = default;
+
+    AlignedBuffer acquire(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        largest_ = std::max(largest_, AlignedBuffer::roundUp(bytes));
+
+        // the smallest free buffer that fits
+        auto best = free_.end();
+        for (auto it = free_.begin(); it != free_.end(); ++it)
+        {
+            if (it->capacity() >= bytes && (best == free_.end() || it->capacity() < best->capacity()))
+            {
+                best = it;
+            }
+        }
+        if (best != free_.end())
+        {
+            AlignedBuffer buffer = std::move(*best);
+            free_.erase(best);
+            return buffer;
+        }
+        return AlignedBuffer(largest_);
+    }
+
+    void release(AlignedBuffer buffer)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        // a buffer smaller than the files need by now would only be replaced, let it go
+        if (buffer.data() && buffer.capacity() >= largest_)
+        {
+            free_.push_back(std::move(buffer));
+        }
+    }
+
+    // The arena of the calling thread, it lives as long as the thread and so across the files of a worker
+    static BufferArena & local()
+    {
+        static thread_local BufferArena arena;
+        return arena;
+    }
+
+private:
+    std::mutex                  mutex_;
+    std::vector<AlignedBuffer>  free_;
+    size_t                      largest_ = 0;
+};
@@ -0,0 +1,289 @@
+#pragma once
+
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+#include "log.hpp"
+#include "threaded.h"
+
+
+// Stereo samples decoded by all the files so far, the measure of throughput
+inline std::atomic<int64_t> & samplesDecoded()
+{
+    static std::atomic<int64_t> samples { 0 };
+    return samples;
+}
+
+
+// The CPUs the process may run on: the affinity mask on Linux, the hardware threads otherwise
+inline int availableCpus()
+{
+    int cpus = int(std::thread::hardware_concurrency());
+#if defined(__linux__)
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        cpus = CPU_COUNT(&set);
+    }
+#endif
+    return std::max(1, cpus);
+}
+
+// The CPU time the cgroup quota gives the process per second (a container's CPU limit), 0 for no quota
+inline double cgroupCpuLimit()
+{
+#if defined(__linux__)
+    auto quota = [] (double q, double period) { return q > 0 && period > 0 ? q / period : 0.; };
+
+    // cgroup v2, the group of the process or the root of its namespace
+    std::string group;
+    {
+        std::ifstream is("/proc/self/cgroup");
+        std::string line;
+        while (std::getline(is, line))
+        {
+            if (line.rfind("0::", 0) == 0)
+            {
+                group = line.substr(3);
+            }
+        }
+    }
+    for (const std::string & dir : { "/sys/fs/cgroup" + group, std::string("/sys/fs/cgroup") })
+    {
+        std::ifstream is(dir + "/cpu.max");
+        std::string max;
+        double period = 0;
+        if (is >> max >> period)
+        {
+            return max == "max" ? 0. : quota(std::atof(max.c_str()), period);
+        }
+    }
+
+    // cgroup v1
+    for (const char * dir : { "/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct" })
+    {
+        std::ifstream qs(std::string(dir) + "/cpu.cfs_quota_us");
+        std::ifstream ps(std::string(dir) + "/cpu.cfs_period_us");
+        double q = 0, period = 0;
+        if (qs >> q && ps >> period)
+        {
+            return quota(q, period);
+        }
+    }
+#endif
+    return 0;
+}
+
+// CPU seconds the process has used, 0 where it is not measured
+inline double processCpuSeconds()
+{
+#if !defined(_WIN32)
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+#endif
+    return 0;
+}
+
+
+// Admits jobs by the memory they are estimated to take. A job waits until it fits into what the running jobs
+// leave of the limit, one job runs whatever its size when there is no other. The segments of a file run under
+// the file's admission, its estimate counts them; a worker waiting for its segments runs only those (see
+// WorkPool::help), so a thread never holds two admissions
+class MemoryBudget
+{
+    MemoryBudget(const MemoryBudget &) = delete;
+    MemoryBudget operator=(const MemoryBudget &) = delete;
+public:
+    explicit MemoryBudget(size_t limit)
+        : limit_(limit)
+    {}
+
+    class Admission
+    {
+        Admission(const Admission &) = delete;
+        Admission operator=(const Admission &) = delete;
+    public:
+        Admission() = default;
+        Admission(Admission && other) noexcept
+            : budget_(std::exchange(other.budget_, nullptr))
+            , bytes_(other.bytes_)
+        {}
+        ~Admission()
+        {
+            if (budget_)
+            {
+                budget_->release(bytes_);
+            }
+        }
+
+    private:
+        friend class MemoryBudget;
+        Admission(MemoryBudget * budget, size_t bytes)
+            : budget_(budget), bytes_(bytes)
+        {}
+
+        MemoryBudget *  budget_ = nullptr;
+        size_t          bytes_ = 0;
+    };
+
+    Admission admit(size_t bytes)
+    {
+        std::unique_lock lock(mtx_);
+        cv_.wait(lock, [this, bytes] { return used_ == 0 || used_ + bytes <= limit_; });
+        used_ += bytes;
+        return Admission(this, bytes);
+    }
+
+    size_t limit() const { return limit_; }
+
+private:
+    void release(size_t bytes)
+    {
+        {
+            std::lock_guard lock(mtx_);
+            used_ -= bytes;
+        }
+        cv_.notify_all();
+    }
+
+    const size_t            limit_;
+    size_t                  used_ = 0;
+    std::mutex              mtx_;
+    std::condition_variable cv_;
+};
+
+
+// Moves the number of active workers of a pool by the throughput it measures. Every interval one worker is
+// added or parked as a trial, and the trial is kept if the decoded samples per second went up with the added
+// worker or did not go down without the parked one. Trials go up to the CPUs the quota allows; workers
+// stalled on I/O are a reason to try more, more workers than the quota gives CPUs a reason to try fewer.
+// After a trial is undone the count holds for a while
+class ConcurrencyController
+{
+    ConcurrencyController(const ConcurrencyController &) = delete;
+    ConcurrencyController operator=(const ConcurrencyController &) = delete;
+public:
+    ConcurrencyController(WorkPool & pool, double cpuLimit)
+        : pool_(pool)
+        , cpuLimit_(cpuLimit > 0 ? cpuLimit : pool.size())
+        , thread_([this] { run(); })
+    {}
+
+    ~ConcurrencyController()
+    {
+        {
+            std::lock_guard lock(mtx_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+    }
+
+private:
+    static constexpr auto Interval = std::chrono::seconds(2);
+    // the change in throughput a trial has to make to count
+    static constexpr double MinGain = 0.05;
+    // intervals without trials after one is undone
+    static constexpr int Hold = 5;
+    // below this share of a CPU per worker the workers mostly wait on I/O
+    static constexpr double Stalled = 0.75;
+    // the share of the quota used when the workers are throttled
+    static constexpr double Throttled = 0.9;
+
+    void run()
+    {
+        auto last = std::chrono::steady_clock::now();
+        int64_t lastSamples = samplesDecoded();
+        double lastCpu = processCpuSeconds();
+
+        std::unique_lock lock(mtx_);
+        while (!cv_.wait_for(lock, Interval, [this] { return stop_; }))
+        {
+            auto now = std::chrono::steady_clock::now();
+            double seconds = std::chrono::duration<double>(now - last).count();
+            int64_t samples = samplesDecoded();
+            double cpu = processCpuSeconds();
+
+            double rate = (samples - lastSamples) / seconds;
+            // CPUs busy on average, -1 when the CPU time is not known
+            double cpus = cpu > 0 ? (cpu - lastCpu) / seconds : -1.;
+            step(rate, cpus);
+
+            last = now;
+            lastSamples = samples;
+            lastCpu = cpu;
+        }
+    }
+
+    void step(double rate, double cpus)
+    {
+        const int active = pool_.active();
+        // few CPUs busy for the workers while the quota has more: they wait on I/O. Throttled workers are
+        //  not busy either but then the quota is used up
+        const bool stalled = cpus >= 0 && cpus < Stalled * active && cpus < Throttled * cpuLimit_;
+
+        if (trial_ != 0)
+        {
+            bool keep = trial_ > 0 ? rate > rateBefore_ * (1 + MinGain) : rate >= rateBefore_ * (1 - MinGain);
+            if (!keep)
+            {
+                pool_.setActive(active - trial_);
+                hold_ = Hold;
+            }
+            trial_ = 0;
+            return;
+        }
+        if (hold_ > 0)
+        {
+            hold_--;
+            return;
+        }
+
+        if (active < pool_.size() && (stalled || active < std::ceil(cpuLimit_)))
+        {
+            trial_ = 1;
+        }
+        else if (active > std::ceil(cpuLimit_) && !stalled)
+        {
+            trial_ = -1;
+        }
+        else
+        {
+            // at the quota and busy: a worker more would only be throttled. The stall is looked at again
+            //  after the hold
+            hold_ = Hold;
+            return;
+        }
+        rateBefore_ = rate;
+        pool_.setActive(active + trial_);
+    }
+
+    WorkPool &              pool_;
+    const double            cpuLimit_;
+    int                     trial_ = 0;
+    int                     hold_ = 0;
+    double                  rateBefore_ = 0;
+
+    std::mutex              mtx_;
+    std::condition_variable cv_;
+    bool                    stop_ = false;
+    std::thread             thread_;
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+
+
+// 64-bit hash of a byte string, words at a time
+inline uint64_t hashBytes(const void * data, size_t size, uint64_t h = 0)
+{
+    auto mix = [&h] (uint64_t w)
+    {
+        h ^= w * 0x9E3779B97F4A7C15ull;
+        h = ((h << 31) | (h >> 33)) * 0xC2B2AE3D27D4EB4Full;
+    };
+    const uint8_t * p = (const uint8_t *)data;
+    for (; size >= 8; p += 8, size -= 8)
+    {
+        uint64_t w;
+        std::memcpy(&w, p, 8);
+        mix(w);
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, p, size);
+    mix(tail ^ (uint64_t(size) << 56));
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    return h;
+}
+
+// The hash of a file's content, 0 if it cannot be read
+inline uint64_t contentHash(const std::filesystem::path & path)
+{
+    std::ifstream is(path, std::ios::binary);
+    if (!is)
+    {
+        return 0;
+    }
+    std::vector<char> buffer(1 << 20);
+    uint64_t h = 0;
+    while (is.read(buffer.data(), buffer.size()) || is.gcount() > 0)
+    {
+        h = hashBytes(buffer.data(), size_t(is.gcount()), h);
+    }
+    return h | 1;
+}
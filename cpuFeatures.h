@@ -0,0 +1,100 @@
+#pragma once
+
+#include <string>
+#include <cstdlib>
+#include <cctype>
+#include <atomic>
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_DISPATCH
+// the kernel variants are built with these on top of the baseline flags of the binary. avx512f brings fma
+// along, contracting is turned off for it so that the float paths round the same at every level
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512dq,avx512vl"), optimize("fp-contract=off")))
+// for the bodies shared by the variants, they are compiled again inside each of them
+#define DISPATCH_INLINE __attribute__((always_inline)) inline
+#else
+#define DISPATCH_INLINE inline
+#endif
+
+
+// The widest instruction set the DSP kernels run with. Every kernel that has variants picks one
+// by simdLevel(), which is detected once and can be lowered for testing by STAR_ECHO_SIMD or --simd
+enum class SimdLevel { SSE2, AVX2, AVX512 };
+
+inline const char * simdLevelName(SimdLevel level)
+{
+    switch (level)
+    {
+    case SimdLevel::SSE2: return "sse2";
+    case SimdLevel::AVX2: return "avx2";
+    case SimdLevel::AVX512: return "avx512";
+    }
+    return "";
+}
+
+inline bool parseSimdLevel(std::string name, SimdLevel & level)
+{
+    std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+    for (auto l : { SimdLevel::SSE2, SimdLevel::AVX2, SimdLevel::AVX512 })
+    {
+        if (name == simdLevelName(l))
+        {
+            level = l;
+            return true;
+        }
+    }
+    return false;
+}
+
+// What the processor (and the OS, for the wider registers) supports
+inline SimdLevel detectSimdLevel()
+{
+#if defined(CPU_DISPATCH)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+        && __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vl"))
+    {
+        return SimdLevel::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return SimdLevel::AVX2;
+    }
+#endif
+    return SimdLevel::SSE2;
+}
+
+namespace cpu_features
+{
+
+inline std::atomic<SimdLevel> & selected()
+{
+    static std::atomic<SimdLevel> level = [] {
+        SimdLevel detected = detectSimdLevel();
+        SimdLevel forced;
+        const char * env = std::getenv("STAR_ECHO_SIMD");
+        if (env && parseSimdLevel(env, forced))
+        {
+            return std::min(forced, detected);
+        }
+        return detected;
+    }();
+    return level;
+}
+
+} // namespace cpu_features
+
+inline SimdLevel simdLevel()
+{
+    return cpu_features::selected().load(std::memory_order_relaxed);
+}
+
+// Forces a level, one above what the processor supports is lowered to it. Returns the level in use
+inline SimdLevel setSimdLevel(SimdLevel level)
+{
+    level = std::min(level, detectSimdLevel());
+    cpu_features::selected().store(level, std::memory_order_relaxed);
+    return level;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#endif
+
+
+// What the float filter chain does against subnormal numbers. The IIR states and the reverb tails decay
+// into the subnormal range once the music stops (the appended silence most of all), where every
+// operation on them takes a slow microcode path on x86.
+//  Flush - FTZ/DAZ are set while the chain runs, subnormals become zero
+//  Noise - white noise far below audibility is added to the chain input, so that the states never decay
+//          that far. It does not depend on the processor's float modes. A plain DC offset would not do,
+//          the high-pass parts of the chain take it out and their states decay all the same
+//  Off   - nothing
+enum class DenormalMode { Off, Flush, Noise };
+
+inline const char * denormalModeName(DenormalMode mode)
+{
+    switch (mode)
+    {
+    case DenormalMode::Off: return "off";
+    case DenormalMode::Flush: return "ftz";
+    case DenormalMode::Noise: return "noise";
+    }
+    return "";
+}
+
+inline bool parseDenormalMode(const std::string & name, DenormalMode & mode)
+{
+    for (auto m : { DenormalMode::Off, DenormalMode::Flush, DenormalMode::Noise })
+    {
+        if (name == denormalModeName(m))
+        {
+            mode = m;
+            return true;
+        }
+    }
+    return false;
+}
+
+// -360 dBFS: nothing of it reaches 32-bit integer output and it is lost in the rounding of any float sample
+// above 1e-10, yet it holds the float and double states far above their smallest normal numbers
+constexpr double DenormalNoise = 1e-18;
+
+// The noise is a hash of the stream position, so that the output does not depend on how the stream was
+// cut into blocks or segments. The channels get unrelated noise, CH and 3D would cancel out their sum
+// or their difference otherwise
+inline double denormalNoise(uint32_t index)
+{
+    uint32_t x = index * 2654435761u;
+    x ^= x >> 15;
+    x *= 0x2c1b3c6du;
+    x ^= x >> 12;
+    return int32_t(x) * (DenormalNoise / 2147483648.0);
+}
+
+template<typename T>
+inline void addDenormalNoise(T * l, T * r, int nbSamples, int step, int64_t position)
+{
+    for (int i = 0; i < nbSamples; i++)
+    {
+        const uint32_t index = uint32_t(position + i) * 2;
+        l[i * step] += T(denormalNoise(index));
+        r[i * step] += T(denormalNoise(index + 1));
+    }
+}
+
+
+// Sets flush-to-zero and denormals-are-zero on the calling thread for its lifetime, the previous mode
+// is restored afterwards so that the thread's other code is not affected
+class ScopedFlushDenormals
+{
+    ScopedFlushDenormals(const ScopedFlushDenormals &) = delete;
+    ScopedFlushDenormals operator=(const ScopedFlushDenormals &) = delete;
+public:
+    explicit ScopedFlushDenormals(bool enable = true)
+    {
+        if (!enable)
+        {
+            return;
+        }
+        active_ = true;
+#if defined(__SSE__) || defined(_M_X64)
+        // FTZ is bit 15, DAZ bit 6
+        saved_ = _mm_getcsr();
+        _mm_setcsr(saved_ | 0x8040);
+#elif defined(__aarch64__)
+        // FZ, bit 24 of FPCR, covers both
+        uint64_t fpcr;
+        asm volatile("mrs %0, fpcr" : "=r"(fpcr));
+        saved_ = fpcr;
+        fpcr |= uint64_t(1) << 24;
+        asm volatile("msr fpcr, %0" : : "r"(fpcr));
+#endif
+    }
+    ~ScopedFlushDenormals()
+    {
+        if (!active_)
+        {
+            return;
+        }
+#if defined(__SSE__) || defined(_M_X64)
+        _mm_setcsr(unsigned(saved_));
+#elif defined(__aarch64__)
+        asm volatile("msr fpcr, %0" : : "r"(saved_));
+#endif
+    }
+
+private:
+    bool        active_ = false;
+    uint64_t    saved_ = 0;
+};
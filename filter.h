@@ -6,6 +6,8 @@
 #include <vector>
 #include <cstdlib>
 
+#include "stateArena.h"
+
 
 template<typename sampleType, typename wideSampleType>
 class Filter
@@ -32,6 +34,9 @@ public:
 
     using sample_t = sampleType;
     using samplew_t = wideSampleType;
+    // The feedback state of the recursive filters. The single precision float chain keeps it in double,
+    // its biquads with poles close to the unit circle drift audibly otherwise
+    using samples_t = std::conditional_t<std::is_floating_point_v<sample_t>, double, samplew_t>;
 
     //static constexpr sample_t MaxValue = std::is_floating_point_v<sample_t> ? 1.f : std::numeric_limits<sample_t>::max();
     //static constexpr sample_t MinValue = std::is_floating_point_v<sample_t> ? 5.f : std::numeric_limits<sample_t>::min();
@@ -54,12 +59,29 @@ public:
         }
     }
 
+    // smulw on the state type
+    static inline samples_t smuls(samples_t a, intfloat_t b)
+    {
+        if constexpr (std::is_integral_v<sample_t>)
+        {
+            return smulw(a, b);
+        }
+        else
+        {
+            return a * b;
+        }
+    }
+
 
     explicit Filter(std::vector<int> && sampleRates)
-        : sampleRates_(sampleRates)
+        : sampleRates_(sampleRates.begin(), sampleRates.end())
     {}
     virtual ~Filter() = default;
 
+    // Filters made while a StateArena::Scope is open are placed in its arena, along with their states
+    static void * operator new(size_t size) { return StateArena::allocateObject(size); }
+    static void operator delete(void * p) noexcept { StateArena::deallocateObject(p); }
+
     virtual void setSamplerate(int sampleRate) = 0;
 
     virtual void filter(sample_t l, const sample_t r,
@@ -67,9 +89,11 @@ public:
 
     //
 
+    // step is the distance between two samples of a channel: 1 for planar buffers, 2 for interleaved ones
+    //  where rb = lb + 1
     void filter(const sample_t * lb, const sample_t * rb,
                 sample_t * lb_out, sample_t * rb_out,
-                int nSamples)
+                int nSamples, int step = 1)
     {
     #if defined(_DEBUG)
         std::vector<sample_t> vl, vr;
@@ -78,15 +102,42 @@ public:
     #endif
         for (int i = 0; i < nSamples; i++)
         {
-            filter(lb[i], rb[i], lb_out + i, rb_out + i);
+            filter(lb[i * step], rb[i * step], lb_out + i * step, rb_out + i * step);
         #if defined(_DEBUG)
             ++sCount;
-            vl[i] = lb_out[i];
-            vr[i] = rb_out[i];
+            vl[i] = lb_out[i * step];
+            vr[i] = rb_out[i * step];
         #endif
         }
     }
 
+    // One stream of a multi-stream call: its own instance of the filter and its stereo buffers, processed in place
+    struct Lane
+    {
+        Filter *    filter;
+        sample_t *  lb;
+        sample_t *  rb;
+        int         step;
+    };
+    // Streams that a lane kernel advances together
+    static constexpr int MaxLanes = 8;
+
+    // Process nSamples of several streams running the same filter type, called on any of the lane filters.
+    // The streams go one after another here, filters with a lane kernel run them side by side
+    virtual void filterLanes(Lane * lanes, int nLanes, int nSamples)
+    {
+        for (int k = 0; k < nLanes; k++)
+        {
+            auto & lane = lanes[k];
+            lane.filter->filter(lane.lb, lane.rb, lane.lb, lane.rb, nSamples, lane.step);
+        }
+    }
+    // Whether filterLanes is worth the lockstep, false when it is the loop above
+    virtual bool hasLaneKernel() const
+    {
+        return false;
+    }
+
     template<typename T>
     static inline T limit(T v)
     {
@@ -150,6 +201,13 @@ public:
         normalizer = n;
     }
 
+    // Take over the peaks seen by another instance of the same filter (that processed another part of the stream)
+    void mergePeaks(const Filter & other)
+    {
+        global_max = std::max(global_max, other.global_max);
+        global_min = std::min(global_min, other.global_min);
+    }
+
     float calcNormFactor() const
     {
         float factor_max = 1.0f, factor_min = 1.0f;
@@ -211,5 +269,5 @@ protected:
     samplew_t   global_min = 0;
     float       normalizer = 1.0;
 
-    std::vector<int> sampleRates_;
+    StateVector<int> sampleRates_;
 };
@@ -0,0 +1,411 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <system_error>
+
+#if !defined(_WIN32)
+#include <csignal>
+#include <cerrno>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#endif
+
+#include "log.hpp"
+#include "threaded.h"
+#include "concurrency.h"
+#include "mediaProcess.h"
+
+
+#if !defined(_WIN32)
+
+// Files are processed in worker processes instead of threads, so that a crash or a hang in a decoder takes only
+// its file with it. Every thread of the pool hands its jobs to a worker process of its own over a pipe and waits
+// for the result under the time limit; a worker that crashes, times out or exits is replaced before the next job,
+// and what its job left behind is removed. The workers are the same program started again with --isolate-worker,
+// they run one file at a time with the options of the run. A job is the input, the output and the normalize flag,
+// a result whether the output was written, the content hash of the input if one was taken and the message
+
+// The descriptor the worker writes its results to, the jobs come on the standard input
+constexpr int IsolatedResultFd = 3;
+
+namespace isolated
+{
+    inline bool writeAll(int fd, const void * data, size_t size)
+    {
+        auto p = (const char *)data;
+        while (size > 0)
+        {
+            ssize_t n = ::write(fd, p, size);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return false;
+            }
+            p += n;
+            size -= size_t(n);
+        }
+        return true;
+    }
+
+    // Reads size bytes unless the deadline passes first (timedOut) or the other end is closed
+    inline bool readAll(int fd, void * data, size_t size, std::chrono::steady_clock::time_point deadline, bool & timedOut)
+    {
+        auto p = (char *)data;
+        while (size > 0)
+        {
+            int timeout = -1;
+            if (deadline != std::chrono::steady_clock::time_point::max())
+            {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+                if (left <= 0)
+                {
+                    timedOut = true;
+                    return false;
+                }
+                timeout = int(std::min<int64_t>(left, 60000));
+            }
+            pollfd pfd { fd, POLLIN, 0 };
+            int r = ::poll(&pfd, 1, timeout);
+            if (r < 0 && errno != EINTR)
+            {
+                return false;
+            }
+            if (r <= 0)
+            {
+                continue;
+            }
+            ssize_t n = ::read(fd, p, size);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return false;
+            }
+            p += n;
+            size -= size_t(n);
+        }
+        return true;
+    }
+
+    inline bool writeString(int fd, const std::string & s)
+    {
+        uint32_t size = uint32_t(s.size());
+        return writeAll(fd, &size, sizeof(size)) && writeAll(fd, s.data(), s.size());
+    }
+
+    inline bool readString(int fd, std::string & s, std::chrono::steady_clock::time_point deadline, bool & timedOut)
+    {
+        uint32_t size;
+        if (!readAll(fd, &size, sizeof(size), deadline, timedOut))
+        {
+            return false;
+        }
+        s.resize(size);
+        return readAll(fd, s.data(), size, deadline, timedOut);
+    }
+}
+
+
+// The loop of a worker process: runs the jobs coming on the standard input until it is closed
+// written and content are set by the finished callback of the process. A job is a task of the pool, so that
+// its segments and pipeline stages run on the pool's other threads
+inline int serveIsolatedJobs(const MediaProcess & process, WorkPool & pool, bool & written, uint64_t & content)
+{
+    const auto never = std::chrono::steady_clock::time_point::max();
+    bool timedOut = false;
+    std::string input, output;
+    uint8_t normalize;
+    while (isolated::readString(0, input, never, timedOut) && isolated::readString(0, output, never, timedOut)
+           && isolated::readAll(0, &normalize, 1, never, timedOut))
+    {
+        written = false;
+        content = 0;
+        std::string result;
+        {
+            TaskGroup job(&pool);
+            job.run([&] { result = process(FileItem { input, output, normalize != 0 }); });
+            job.wait();
+        }
+        const uint8_t ok = written;
+        if (!isolated::writeAll(IsolatedResultFd, &ok, 1) || !isolated::writeAll(IsolatedResultFd, &content, sizeof(content))
+            || !isolated::writeString(IsolatedResultFd, result))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+class IsolatedProcess
+{
+    IsolatedProcess(const IsolatedProcess &) = delete;
+    IsolatedProcess operator=(const IsolatedProcess &) = delete;
+public:
+    struct Limits
+    {
+        // wall-clock seconds per file, 0 is no limit
+        int timeout = 0;
+        // bytes of memory a worker may take, 0 is no limit
+        size_t memory = 0;
+        // bytes the files in work in all the workers are estimated to take by footprint, 0 is no limit
+        //  (see MemoryBudget); the workers run without one of their own
+        size_t maxMemory = 0;
+        std::function<size_t(const FileItem &)> footprint;
+    };
+
+    // command is the program and the arguments that start a worker, one is started for each of the threads
+    //  when it takes its first job. finished is told how each file ended
+    IsolatedProcess(std::vector<std::string> command, int threads, const Limits & limits,
+                    std::function<void(const FileItem &, bool, uint64_t)> finished)
+        : command_(std::move(command))
+        , limits_(limits)
+        , finished_(std::move(finished))
+        , workers_(size_t(std::max(1, threads)))
+    {
+        if (limits_.maxMemory > 0 && limits_.footprint)
+        {
+            memoryBudget_ = std::make_unique<MemoryBudget>(limits_.maxMemory);
+        }
+        // a worker gone while its job is written is noticed from the result pipe
+        std::signal(SIGPIPE, SIG_IGN);
+    }
+
+    ~IsolatedProcess()
+    {
+        for (auto & worker : workers_)
+        {
+            stop(worker, false);
+        }
+    }
+
+    std::string operator()(const FileItem & item)
+    {
+        Worker & worker = workers_[size_t(std::max(0, WorkPool::currentIndex())) % workers_.size()];
+        // the job is admitted before it is written to the worker and holds its admission until the result is
+        //  read, an output the worker then finds in the cache has taken its estimate for that while
+        std::optional<MemoryBudget::Admission> admission;
+        if (memoryBudget_)
+        {
+            admission.emplace(memoryBudget_->admit(limits_.footprint(item)));
+        }
+        std::string result;
+        bool written = false;
+        uint64_t content = 0;
+        std::string failure = run(worker, item, written, content, result);
+        admission.reset();
+        if (failure.empty())
+        {
+            if (finished_)
+            {
+                finished_(item, written, content);
+            }
+            if (!written)
+            {
+                recordFailure(item);
+            }
+            return result;
+        }
+
+        // the worker is gone and its job with it
+        removeLeftovers(item);
+        if (finished_)
+        {
+            finished_(item, false, 0);
+        }
+        recordFailure(item);
+        return item.output.string() + " failed : " + failure;
+    }
+
+    // The inputs whose output was not written
+    std::vector<std::filesystem::path> failures() const
+    {
+        std::lock_guard lock(failuresMtx_);
+        return failures_;
+    }
+
+private:
+    struct Worker
+    {
+        pid_t   pid = -1;
+        int     jobs = -1;
+        int     results = -1;
+    };
+
+    // Returns why the job ended without a result, empty when it has one
+    std::string run(Worker & worker, const FileItem & item, bool & written, uint64_t & content, std::string & result)
+    {
+        if (worker.pid < 0 && !start(worker))
+        {
+            return "cannot start a worker process";
+        }
+
+        const uint8_t normalize = item.normalize;
+        if (!isolated::writeString(worker.jobs, item.input.string()) || !isolated::writeString(worker.jobs, item.output.string())
+            || !isolated::writeAll(worker.jobs, &normalize, 1))
+        {
+            // it went away after the last job, this one has not started
+            stop(worker, true);
+            if (!start(worker) || !isolated::writeString(worker.jobs, item.input.string())
+                || !isolated::writeString(worker.jobs, item.output.string()) || !isolated::writeAll(worker.jobs, &normalize, 1))
+            {
+                stop(worker, true);
+                return "cannot start a worker process";
+            }
+        }
+
+        auto deadline = limits_.timeout > 0
+            ? std::chrono::steady_clock::now() + std::chrono::seconds(limits_.timeout)
+            : std::chrono::steady_clock::time_point::max();
+        bool timedOut = false;
+        uint8_t ok = 0;
+        if (isolated::readAll(worker.results, &ok, 1, deadline, timedOut) && isolated::readAll(worker.results, &content, sizeof(content), deadline, timedOut)
+            && isolated::readString(worker.results, result, deadline, timedOut))
+        {
+            written = ok != 0;
+            return {};
+        }
+
+        if (timedOut)
+        {
+            stop(worker, true);
+            return "timed out after " + std::to_string(limits_.timeout) + " s";
+        }
+        int status = stop(worker, false);
+        if (WIFSIGNALED(status))
+        {
+            return "crashed (" + std::string(strsignal(WTERMSIG(status))) + ")";
+        }
+        return "the worker exited with " + std::to_string(WIFEXITED(status) ? WEXITSTATUS(status) : status);
+    }
+
+    bool start(Worker & worker)
+    {
+        std::vector<char *> argv;
+        for (auto & arg : command_)
+        {
+            argv.push_back(const_cast<char *>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+
+        // no other worker may inherit the pipes, it would keep them open after this one is gone
+        std::lock_guard lock(startMtx_);
+        int jobs[2], results[2];
+        if (pipe(jobs) != 0)
+        {
+            return false;
+        }
+        if (pipe(results) != 0)
+        {
+            ::close(jobs[0]);
+            ::close(jobs[1]);
+            return false;
+        }
+        for (int fd : { jobs[0], jobs[1], results[0], results[1] })
+        {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            // only async-signal-safe calls until exec
+            dup2(jobs[0], 0);
+            dup2(results[1], IsolatedResultFd);
+            if (limits_.memory > 0)
+            {
+                rlimit limit { rlim_t(limits_.memory), rlim_t(limits_.memory) };
+            #if defined(__linux__)
+                // the heap and the private mappings, not the mapped files
+                setrlimit(RLIMIT_DATA, &limit);
+            #else
+                setrlimit(RLIMIT_AS, &limit);
+            #endif
+            }
+            execv(argv[0], argv.data());
+            _exit(127);
+        }
+        ::close(jobs[0]);
+        ::close(results[1]);
+        if (pid < 0)
+        {
+            ::close(jobs[1]);
+            ::close(results[0]);
+            return false;
+        }
+        worker = { pid, jobs[1], results[0] };
+        return true;
+    }
+
+    // Closes the jobs pipe, kills the worker first if asked, and returns its wait status
+    static int stop(Worker & worker, bool kill)
+    {
+        if (worker.pid < 0)
+        {
+            return 0;
+        }
+        if (kill)
+        {
+            ::kill(worker.pid, SIGKILL);
+        }
+        ::close(worker.jobs);
+        ::close(worker.results);
+        int status = 0;
+        while (waitpid(worker.pid, &status, 0) < 0 && errno == EINTR)
+        {
+        }
+        worker = {};
+        return status;
+    }
+
+    // The temporary output and segment files of a job that did not end
+    static void removeLeftovers(const FileItem & item)
+    {
+        const auto prefix = item.output.filename().string() + ".tmp";
+        std::error_code ec;
+        for (std::filesystem::directory_iterator it(item.output.parent_path(), ec), end; !ec && it != end; it.increment(ec))
+        {
+            if (it->path().filename().string().rfind(prefix, 0) == 0)
+            {
+                std::error_code removeEc;
+                std::filesystem::remove(it->path(), removeEc);
+            }
+        }
+    }
+
+    void recordFailure(const FileItem & item)
+    {
+        std::lock_guard lock(failuresMtx_);
+        failures_.push_back(item.input);
+    }
+
+    const std::vector<std::string>  command_;
+    const Limits                    limits_;
+    std::function<void(const FileItem &, bool, uint64_t)> finished_;
+    std::unique_ptr<MemoryBudget>   memoryBudget_;
+    std::vector<Worker>             workers_;
+    std::mutex                      startMtx_;
+
+    mutable std::mutex              failuresMtx_;
+    std::vector<std::filesystem::path> failures_;
+};
+
+#endif
@@ -0,0 +1,314 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <unordered_map>
+#include <mutex>
+
+#include "log.hpp"
+#include "contentHash.h"
+
+
+// The record of the files processed into an output tree, so that a run processes only the files that are new,
+// changed since, failed or were made by another chain. A file counts as changed when its size differs, or its
+// modification time does and its content hash too; its header is not read.
+// The file is a journal: a record is appended as each file finishes, the last record of a path holds. It is
+// rewritten without the stale records when they make up most of it
+class Manifest
+{
+    Manifest(const Manifest &) = delete;
+    Manifest operator=(const Manifest &) = delete;
+public:
+    // chain is the description of the filters the run applies, see chainDescription
+    Manifest(const std::filesystem::path & path, const std::wstring & chain)
+        : path_(path)
+    {
+        load();
+        const bool compact = !validHeader_ || records_ > 2 * entries_.size() + 1024;
+        chain_ = chainIndex(chain, !compact);
+        if (compact)
+        {
+            rewrite();
+        }
+    }
+
+    // Whether the file has to be processed. An output that is there without a record was made by a run
+    // without the manifest and counts as done
+    bool needed(const std::filesystem::path & input, bool outputExists)
+    {
+        if (!outputExists)
+        {
+            return true;
+        }
+        Entry current;
+        if (!stat(input, current))
+        {
+            return true;
+        }
+
+        Entry known;
+        {
+            std::lock_guard lock(mtx_);
+            auto found = entries_.find(input.native());
+            if (found == entries_.end())
+            {
+                current.status = Done;
+                current.chain = chain_;
+                append(input, current);
+                return false;
+            }
+            known = found->second;
+        }
+        if (known.status != Done || known.chain != chain_ || known.size != current.size)
+        {
+            return true;
+        }
+        if (known.mtime == current.mtime)
+        {
+            return false;
+        }
+        // touched, maybe not changed
+        if (known.hash == 0 || contentHash(input) != known.hash)
+        {
+            return true;
+        }
+        known.mtime = current.mtime;
+        std::lock_guard lock(mtx_);
+        append(input, known);
+        return false;
+    }
+
+    // Records how the processing of the file ended. content is its hash when the caller has one, see contentHash,
+    // the file is read for it otherwise
+    void finished(const std::filesystem::path & input, bool written, uint64_t content = 0)
+    {
+        Entry entry;
+        stat(input, entry);
+        entry.status = written ? Done : Failed;
+        entry.chain = chain_;
+        entry.hash = !written ? 0 : content != 0 ? content : contentHash(input);
+        std::lock_guard lock(mtx_);
+        append(input, entry);
+    }
+
+private:
+    static constexpr char Magic[4] = { 'S', 'E', 'M', 'F' };
+    static constexpr uint32_t Version = 1;
+    // the types of the journal records
+    static constexpr uint8_t ChainRecord = 'C';
+    static constexpr uint8_t FileRecord = 'F';
+
+    enum Status : uint8_t { Done = 1, Failed = 2 };
+
+    struct Entry
+    {
+        uint64_t    size = 0;
+        int64_t     mtime = 0;
+        uint64_t    hash = 0;
+        uint32_t    chain = 0;
+        uint8_t     status = 0;
+    };
+
+    using Name = std::filesystem::path::string_type;
+
+    static bool stat(const std::filesystem::path & input, Entry & entry)
+    {
+        std::error_code ec;
+        entry.size = std::filesystem::file_size(input, ec);
+        if (ec)
+        {
+            return false;
+        }
+        entry.mtime = int64_t(std::filesystem::last_write_time(input, ec).time_since_epoch().count());
+        return !ec;
+    }
+
+    template<typename T>
+    static void put(std::string & out, const T & value)
+    {
+        out.append((const char *)&value, sizeof(value));
+    }
+    static void putString(std::string & out, const void * data, size_t bytes)
+    {
+        put(out, uint32_t(bytes));
+        out.append((const char *)data, bytes);
+    }
+
+    static std::string chainRecord(const std::wstring & chain)
+    {
+        std::string record(1, char(ChainRecord));
+        putString(record, chain.data(), chain.size() * sizeof(wchar_t));
+        return record;
+    }
+    static std::string fileRecord(const Name & name, const Entry & entry)
+    {
+        std::string record(1, char(FileRecord));
+        putString(record, name.data(), name.size() * sizeof(Name::value_type));
+        put(record, entry.size);
+        put(record, entry.mtime);
+        put(record, entry.hash);
+        put(record, entry.chain);
+        put(record, entry.status);
+        return record;
+    }
+
+    // A journal cut short by a crash loses its last record
+    void load()
+    {
+        std::ifstream is(path_, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+        validHeader_ = data.size() >= 8 && std::memcmp(data.data(), Magic, 4) == 0
+            && std::memcmp(data.data() + 4, &Version, 4) == 0;
+        if (!validHeader_)
+        {
+            return;
+        }
+        journalBytes_ = 8;
+
+        const char * p = data.data() + 8;
+        const char * end = data.data() + data.size();
+        auto get = [&p, end] (void * value, size_t bytes)
+        {
+            if (size_t(end - p) < bytes)
+            {
+                return false;
+            }
+            std::memcpy(value, p, bytes);
+            p += bytes;
+            return true;
+        };
+        auto getString = [&] (std::string & bytes)
+        {
+            uint32_t size;
+            if (!get(&size, 4) || size_t(end - p) < size)
+            {
+                return false;
+            }
+            bytes.assign(p, size);
+            p += size;
+            return true;
+        };
+
+        uint8_t type;
+        std::string bytes;
+        while (get(&type, 1) && getString(bytes))
+        {
+            if (type == ChainRecord)
+            {
+                chains_.emplace_back((const wchar_t *)bytes.data(), bytes.size() / sizeof(wchar_t));
+            }
+            else if (type == FileRecord)
+            {
+                Entry entry;
+                if (!get(&entry.size, 8) || !get(&entry.mtime, 8) || !get(&entry.hash, 8) || !get(&entry.chain, 4) || !get(&entry.status, 1))
+                {
+                    break;
+                }
+                entries_[Name((const Name::value_type *)bytes.data(), bytes.size() / sizeof(Name::value_type))] = entry;
+                records_++;
+            }
+            else
+            {
+                break;
+            }
+            journalBytes_ = size_t(p - data.data());
+        }
+    }
+
+    uint32_t chainIndex(const std::wstring & chain, bool record)
+    {
+        for (size_t i = 0; i < chains_.size(); i++)
+        {
+            if (chains_[i] == chain)
+            {
+                return uint32_t(i);
+            }
+        }
+        chains_.push_back(chain);
+        if (record)
+        {
+            write(chainRecord(chain));
+        }
+        return uint32_t(chains_.size() - 1);
+    }
+
+    // The journal without the stale records, written aside and moved over the old one
+    void rewrite()
+    {
+        std::string data(Magic, 4);
+        put(data, Version);
+        for (auto & chain : chains_)
+        {
+            data += chainRecord(chain);
+        }
+        for (auto & [name, entry] : entries_)
+        {
+            data += fileRecord(name, entry);
+        }
+
+        std::error_code ec;
+        std::filesystem::create_directories(path_.parent_path(), ec);
+        auto temp = path_;
+        temp += ".tmp";
+        {
+            std::ofstream os(temp, std::ios::binary | std::ios::trunc);
+            os.write(data.data(), data.size());
+            if (!os)
+            {
+                err() << "cannot write the manifest " << path_.string();
+                return;
+            }
+        }
+        std::filesystem::rename(temp, path_, ec);
+        if (ec)
+        {
+            err() << "cannot write the manifest " << path_.string() << " : " << ec.message();
+            return;
+        }
+        validHeader_ = true;
+        records_ = entries_.size();
+        journalBytes_ = data.size();
+    }
+
+    // under mtx_
+    void append(const std::filesystem::path & input, const Entry & entry)
+    {
+        entries_[input.native()] = entry;
+        records_++;
+        write(fileRecord(input.native(), entry));
+    }
+
+    void write(const std::string & record)
+    {
+        if (!journal_.is_open())
+        {
+            // a record cut short by a crash is dropped before more follow it
+            std::error_code ec;
+            std::filesystem::resize_file(path_, journalBytes_, ec);
+            journal_.open(path_, std::ios::binary | std::ios::app);
+        }
+        journal_.write(record.data(), record.size());
+        journal_.flush();
+        journalBytes_ += record.size();
+        if (!journal_ && !failed_)
+        {
+            err() << "cannot write the manifest " << path_.string();
+            failed_ = true;
+        }
+    }
+
+    const std::filesystem::path         path_;
+    std::mutex                          mtx_;
+    std::unordered_map<Name, Entry>     entries_;
+    std::vector<std::wstring>           chains_;
+    uint32_t                            chain_ = 0;
+    size_t                              records_ = 0;
+    size_t                              journalBytes_ = 0;
+    bool                                validHeader_ = false;
+    bool                                failed_ = false;
+    std::ofstream                       journal_;
+};
@@ -8,16 +8,38 @@ extern "C" {
 #include "libavcodec/avcodec.h"
 #include <libswresample/swresample.h>
 #include <libavutil/channel_layout.h>
-#include <libavutil/audio_fifo.h>
 #ifdef __cplusplus  
 }
 #endif
 
 #include <variant>
+#include <deque>
+#include <fstream>
+#include <limits>
+#include <cmath>
+#include <array>
+#include <algorithm>
+#include <chrono>
+#include <list>
+#include <optional>
+#include <mutex>
+#include <condition_variable>
 
 #include <boost/algorithm/string.hpp>
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
 
 #include "log.hpp"
+#include "spscQueue.h"
+#include "sampleConvert.h"
+#include "bufferArena.h"
+#include "stateArena.h"
+#include "denormals.h"
+#include "threaded.h"
+#include "concurrency.h"
+#include "outputCache.h"
+#include "pcmCache.h"
 
 #include "mediaProcess.h"
 
@@ -147,7 +169,9 @@ static scoped_ptr<AVCodecContext> createCodec(AVCodecParameters * codecpar,
     return ctx;
 }
 
-static int encodeFrame(AVFrame * frame, AVFormatContext * avfmt_out, AVCodecContext * avcodec_out, int streamIndex)
+// Send a frame (NULL flushes) to the encoder and write out every packet it has ready.
+// Returns 0 when the encoder wants more input and AVERROR_EOF once it is done
+static int encodeFrame(AVFrame * frame, AVPacket * packet, AVFormatContext * avfmt_out, AVCodecContext * avcodec_out, int streamIndex)
 {
     int r = avcodec_send_frame(avcodec_out, frame);
     if (r != 0 && r != AVERROR_EOF)
@@ -155,9 +179,7 @@ static int encodeFrame(AVFrame * frame, AVFormatContext * avfmt_out, AVCodecCont
         throw MPError("failed to send frame", r);
     }
 
-    scoped_ptr<AVPacket> packet(av_packet_alloc(), [] (auto * d) { av_packet_free(&d); });
-
-    if ((r = avcodec_receive_packet(avcodec_out, packet)) == 0)
+    while ((r = avcodec_receive_packet(avcodec_out, packet)) == 0)
     {
         //if (frame && packet.dts == 0)
         //{
@@ -171,17 +193,15 @@ static int encodeFrame(AVFrame * frame, AVFormatContext * avfmt_out, AVCodecCont
         // <TIP: write a filtered raw frame to the output file with a proper codec-encoding>
         // <FLOW: AVFrame frame -> AVCodecContext avcodec_out -> AVPacket packet -> AVFormatContext avfmt_out -> FILE outfile >
         // Write a (codec-processed) packet to an output media file
-        if ((r = av_write_frame(avfmt_out, packet)) == 0)
-        {
-            //return r;
-        }
-        else
+        r = av_write_frame(avfmt_out, packet);
+        av_packet_unref(packet);
+        if (r != 0)
         {
             throw MPError("failed to write frame", r);
         }
     }
     // When we got EOF, there might be still remaining packets in AVCodecContext avcodec_out not encoded, yet
-    else if (r == AVERROR(EAGAIN))
+    if (r == AVERROR(EAGAIN))
     {
         return 0;
     }
@@ -193,92 +213,1250 @@ static int encodeFrame(AVFrame * frame, AVFormatContext * avfmt_out, AVCodecCont
     return r;
 }
 
-static void writeToFifo(AVAudioFifo * fifo, void ** buffers, int nbSamples)
+// The layout of the plain sample formats that the in-house converters handle
+static bool sampleLayout(AVSampleFormat fmt, SampleLayout & layout)
 {
-    int r;
+    switch (fmt)
+    {
+    case AV_SAMPLE_FMT_S16:  layout = { SampleKind::S16, false }; return true;
+    case AV_SAMPLE_FMT_S16P: layout = { SampleKind::S16, true }; return true;
+    case AV_SAMPLE_FMT_S32:  layout = { SampleKind::S32, false }; return true;
+    case AV_SAMPLE_FMT_S32P: layout = { SampleKind::S32, true }; return true;
+    case AV_SAMPLE_FMT_FLT:  layout = { SampleKind::FLT, false }; return true;
+    case AV_SAMPLE_FMT_FLTP: layout = { SampleKind::FLT, true }; return true;
+    default: return false;
+    }
+}
+
+// The stereo converter kernel between two formats, nullptr when swr is needed
+static ConvertKernel findConvertKernel(AVSampleFormat in, AVSampleFormat out)
+{
+    SampleLayout inLayout, outLayout;
+    if (!sampleLayout(in, inLayout) || !sampleLayout(out, outLayout))
+    {
+        return nullptr;
+    }
+    return findConvertKernel(inLayout, outLayout);
+}
+
+//
+
+// A chunk of stereo samples in the filter format, planar or interleaved.
+// The planes come from the arena of the thread that made the block and go back to it with the block
+struct SampleBlock
+{
+    explicit SampleBlock(BufferArena & arena = BufferArena::local())
+        : arena_(&arena)
+    {}
+    SampleBlock(SampleBlock &&) = default;
+    ~SampleBlock()
+    {
+        for (auto & plane : planes)
+        {
+            arena_->release(std::move(plane));
+        }
+    }
+
+    std::array<AlignedBuffer, 2> planes;
+    // Points either to planes or to a borrowed decoder frame.
+    // Interleaved samples all live in the first plane and data[1] points to the first right sample
+    std::array<uint8_t *, 2> data { nullptr, nullptr };
+    // The distance between two samples of a channel: 1 planar, 2 interleaved
+    int step = 1;
+    int nbSamples = 0;
+    // Filter-rate sample index of the first sample in the stream
+    int64_t position = 0;
+
+    // Make room for the samples in the own planes and switch data to them
+    void reserve(int samples, int sampleBytes, bool interleaved)
+    {
+        step = interleaved ? 2 : 1;
+        const size_t planeBytes = size_t(samples) * sampleBytes * step;
+        for (size_t i = 0; i < (interleaved ? 1 : planes.size()); i++)
+        {
+            if (planes[i].capacity() < planeBytes)
+            {
+                arena_->release(std::move(planes[i]));
+                planes[i] = arena_->acquire(planeBytes);
+            }
+        }
+        data[0] = planes[0].data();
+        data[1] = interleaved ? data[0] + sampleBytes : planes[1].data();
+    }
+
+    void borrow(uint8_t * d0, uint8_t * d1, int samples, int sampleStep)
+    {
+        data = { d0, d1 };
+        step = sampleStep;
+        nbSamples = samples;
+    }
+
+    bool isBorrowed() const
+    {
+        return data[0] != planes[0].data();
+    }
+
+private:
+    BufferArena * arena_;
+};
+
+// Whether the encoder of the codec takes the format in planar (1) or interleaved (0) layout as is, -1 if in neither
+static int encoderPlanar(AVCodecID codecId, AVSampleFormat format)
+{
+    if (codecId == AV_CODEC_ID_FIRST_AUDIO)
+    {
+        // pcm, do_process picks the packed S32/F32 codec
+        return 0;
+    }
+    auto * codec = codecId != AV_CODEC_ID_NONE ? avcodec_find_encoder(codecId) : nullptr;
+    if (!codec || !codec->sample_fmts)
+    {
+        return -1;
+    }
+    for (auto * fmt = codec->sample_fmts; *fmt != AV_SAMPLE_FMT_NONE; ++fmt)
+    {
+        if (av_get_packed_sample_fmt(*fmt) == av_get_packed_sample_fmt(format))
+        {
+            return av_sample_fmt_is_planar(*fmt);
+        }
+    }
+    return -1;
+}
+
+// Samples per tile of the chain executor. A tile of stereo samples takes a sixteenth of the L1 data cache,
+// the rest is left to the filter states that the tile passes through
+static int autoTileSamples(int sampleBytes)
+{
+    static const long l1 = [] ()
+    {
+    #if defined(_SC_LEVEL1_DCACHE_SIZE)
+        long size = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+        if (size > 0)
+        {
+            return size;
+        }
+    #endif
+        return 32768L;
+    }();
+    return std::clamp(int(l1 / 16 / (2 * sampleBytes)) / 64 * 64, 64, 4096);
+}
+
+// The appended silence goes out in blocks of up to this many samples
+static constexpr int MaxSilenceBlock = 16384;
+
+//
+
+using FilterChain = std::variant<
+    // ! update filterFormat and params.codec_id !
+    std::vector<std::unique_ptr<Filter<int16_t, int32_t>>>,
+    std::vector<std::unique_ptr<Filter<int32_t, int64_t>>>,
+    std::vector<std::unique_ptr<Filter<float, double>>>,
+    std::vector<std::unique_ptr<Filter<float, float>>>
+>;
+
+
+// The decoding half of a file: demuxer, decoder, input converter and the filter chain
+class MediaInput
+{
+    MediaInput(const MediaInput &) = delete;
+    MediaInput operator=(const MediaInput &) = delete;
+public:
+    // The filter layout follows the output codec's encoder when given
+    MediaInput(const std::filesystem::path & input, const FilterFabric & fab, const std::vector<float> & normalizers,
+               bool withImage = true, AVCodecID outputCodec = AV_CODEC_ID_NONE)
+        : fab_(fab)
+        , normalizers_(normalizers)
+    {
+        int r;
+
+        AVFormatContext * ctx = nullptr;
+        // open the input music file
+        if ((r = avformat_open_input(&ctx, input.string().c_str(), NULL, NULL)) != 0)
+            throw MPError("failed to open input media", r);
+        avfmt_.reset(ctx);
+
+        // ensure a stream exists in the input music file
+        if ((r = avformat_find_stream_info(avfmt_, NULL)) < 0)
+            throw MPError("no media stream", r);
+
+        //
+        //av_dump_format(avfmt_, 0, "*", false);
+        //
+
+        for (int i = 0; i < avfmt_->nb_streams; i++)
+        {
+            auto & stream = avfmt_->streams[i];
+
+            // there might be several attaches pic streams, so we pick the last?
+            if (stream->disposition & AV_DISPOSITION_ATTACHED_PIC)
+            {
+                imageStream_ = stream;
+            }
+
+            if (stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+            {
+                if (audioStream_) throw MPError("using multiple audio streams is not supported");
+
+                audioStream_ = stream;
+            }
+        }
+        if (!audioStream_) throw MPError("no audio stream is found");
+
+        codec_ = createCodec(audioStream_->codecpar);
+        if (withImage)
+        {
+            imageCodec_ = createCodec(imageStream_ ? imageStream_->codecpar : nullptr);
+        }
+
+        if (codec_->sample_fmt == AV_SAMPLE_FMT_FLT || codec_->sample_fmt == AV_SAMPLE_FMT_FLTP
+            || codec_->sample_fmt == AV_SAMPLE_FMT_DBL || codec_->sample_fmt == AV_SAMPLE_FMT_DBLP)
+        {
+            filterFormat_ = AV_SAMPLE_FMT_FLTP;
+        }
+        else if (fab_.int16Chain() && isSixteenBit(codec_))
+        {
+            // in the 16-bit fixed point of the original DNSE, nothing is lost on the way in or out
+            filterFormat_ = AV_SAMPLE_FMT_S16P;
+        }
+        else
+        {
+            filterFormat_ = AV_SAMPLE_FMT_S32P;
+        }
+
+        // The filters run on either layout. Take the one the encoder accepts as is, else the decoder's,
+        //  so that at most one side has to repack the samples
+        int planar = encoderPlanar(outputCodec, filterFormat_);
+        if (planar < 0)
+        {
+            planar = av_sample_fmt_is_planar(codec_->sample_fmt);
+        }
+        if (!planar)
+        {
+            filterFormat_ = av_get_packed_sample_fmt(filterFormat_);
+        }
+        interleaved_ = !planar;
+        filterSampleBytes_ = av_get_bytes_per_sample(filterFormat_);
+        tileSamples_ = autoTileSamples(filterSampleBytes_);
+
+        createFilters();
+
+        // SwrContext contains the audio file's sound quality parameters, such as the audio channel left/right flags (mono/stereo), 
+        //  sampling format (e.g., 16 bits), and sampling rate (e.g., 44kHz)
+
+        /* Force the input audio channel to have front left & right */
+        /* Force the sampling format to be signed-X-bit-planar */
+        /* Force the sampling rate to be agreed sample rate */
+
+        // Plain repacking of stereo samples does not need the general purpose converter
+        if (codec_->ch_layout.nb_channels == 2 && codec_->sample_rate == filterSampleRate_)
+        {
+            convert_ = findConvertKernel(codec_->sample_fmt, filterFormat_);
+        }
+
+        if (!convert_
+            && (codec_->ch_layout.nb_channels != 2
+                || codec_->sample_fmt != filterFormat_
+                || (codec_->sample_rate != filterSampleRate_)))
+        {
+            swr_.reset(swr_alloc());
+            if (!swr_) throw MPError("swr_alloc failed");
+
+            AVChannelLayout stereoLayout = AV_CHANNEL_LAYOUT_STEREO;
+            auto swr = swr_.get();
+            // Arguments: (swr_ctx, out, out, out, in, in, in, log_offset, log_ctx)
+            r = swr_alloc_set_opts2(&swr,
+                                    &stereoLayout, filterFormat_, filterSampleRate_,
+                                    &codec_->ch_layout, codec_->sample_fmt, codec_->sample_rate,
+                                    0, NULL);
+            if (r != 0) throw MPError("swr_alloc_set_opts2 (in) failed", r);
+
+            if ((r = swr_init(swr_)) != 0) throw MPError("input converter init failed", r);
+        }
+
+        frame_.reset(av_frame_alloc());
+        if (!frame_) throw MPError("failed to allocate frame");
+        packet_.reset(av_packet_alloc());
+        if (!packet_) throw MPError("failed to allocate packet");
+
+        silenceSamples_ = fab_.getSilence() * filterSampleRate_;
+        silenceLeft_ = silenceSamples_;
+    }
+
+    AVFormatContext * format() const { return avfmt_; }
+    AVStream * audioStream() const { return audioStream_; }
+    AVStream * imageStream() const { return imageStream_; }
+    AVCodecContext * codec() const { return codec_; }
+    AVCodecContext * imageCodec() const { return imageCodec_; }
+    AVSampleFormat filterFormat() const { return filterFormat_; }
+    bool interleaved() const { return interleaved_; }
+    // 0 keeps the size picked from the cache
+    void setTileSamples(int samples) { if (samples > 0) tileSamples_ = samples; }
+    void setDenormals(DenormalMode mode) { denormals_ = mode; }
+    int tileSamples() const { return tileSamples_; }
+
+    // Decode from the cache when it has the input in the filter format and rate, else keep what is decoded
+    //  there. content is the hash of the input file
+    void usePcmCache(PcmCache & cache, uint64_t content)
+    {
+        PcmCache::Header header;
+        header.format = filterFormat_;
+        header.sampleRate = filterSampleRate_;
+        header.sampleBytes = filterSampleBytes_;
+        header.interleaved = interleaved_;
+        auto path = cache.path(content, header);
+        pcm_ = cache.open(path, header);
+        if (!pcm_ && position_ == 0 && !inputEof_)
+        {
+            pcmWriter_ = std::make_unique<PcmCache::Writer>(cache, path, header);
+        }
+    }
+    int filterSampleRate() const { return filterSampleRate_; }
+    FilterChain & filters() { return filters_; }
+    size_t filterCount() const { return std::visit([] (auto && fs) { return fs.size(); }, filters_); }
+
+    // The input length in filter-rate samples, 0 if the container does not tell
+    int64_t duration() const
+    {
+        if (avfmt_->duration == AV_NOPTS_VALUE || avfmt_->duration <= 0)
+        {
+            return 0;
+        }
+        return av_rescale(avfmt_->duration, filterSampleRate_, AV_TIME_BASE);
+    }
+
+    // Restart decoding at or before the given filter-rate sample with fresh converter and filter states.
+    // The decoded blocks are positioned by the input timestamps from here on
+    void seek(int64_t position)
+    {
+        int r;
+
+        // only a whole stream goes into the cache
+        pcmWriter_.reset();
+        if (pcm_)
+        {
+            pcmIndex_ = std::clamp<int64_t>(position - pcm_->first(), 0, pcm_->samples());
+        }
+        else
+        {
+            auto startTime = audioStream_->start_time != AV_NOPTS_VALUE ? audioStream_->start_time : 0;
+            auto ts = startTime + av_rescale_q(std::max<int64_t>(0, position), AVRational { 1, filterSampleRate_ }, audioStream_->time_base);
+            if ((r = av_seek_frame(avfmt_, audioStream_->index, ts, AVSEEK_FLAG_BACKWARD)) < 0)
+                throw MPError("failed to seek input", r);
+
+            avcodec_flush_buffers(codec_);
+            if (swr_ && (r = swr_init(swr_)) != 0)
+                throw MPError("input converter init failed", r);
+        }
+
+        createFilters();
+
+        position_ = 0;
+        rebase_ = true;
+        inputEof_ = false;
+        draining_ = false;
+        silenceLeft_ = silenceSamples_;
+    }
+
+    // Decode stage: fill the block with the next filter-format samples, returns false at the end of the input.
+    // A borrowing block may point to the decoder's frame which is only valid until the next call
+    bool decode(SampleBlock & block, bool canBorrow)
+    {
+        block.nbSamples = 0;
+
+        // the noise goes into the block, a decoder frame cannot take it
+        const bool addNoise = denormals_ == DenormalMode::Noise && av_get_packed_sample_fmt(filterFormat_) == AV_SAMPLE_FMT_FLT;
+
+        // convert can produce no samples ... if the input is like 1 sample ... uhhh 
+        while (block.nbSamples == 0)
+        {
+            if (pcm_ && !inputEof_)
+            {
+                if (pcmIndex_ < pcm_->samples())
+                {
+                    position_ = pcm_->first() + pcmIndex_;
+                    const uint8_t * left;
+                    const uint8_t * right;
+                    const int samples = pcm_->at(pcmIndex_, left, right);
+                    const int step = interleaved_ ? 2 : 1;
+                    // the mapped file is not written, the filters write to the block's own planes
+                    if (canBorrow && !addNoise)
+                    {
+                        block.borrow((uint8_t *)left, (uint8_t *)right, samples, step);
+                    }
+                    else
+                    {
+                        block.reserve(samples, filterSampleBytes_, interleaved_);
+                        if (interleaved_)
+                        {
+                            std::copy_n(left, size_t(samples) * filterSampleBytes_ * 2, block.data[0]);
+                        }
+                        else
+                        {
+                            std::copy_n(left, size_t(samples) * filterSampleBytes_, block.data[0]);
+                            std::copy_n(right, size_t(samples) * filterSampleBytes_, block.data[1]);
+                        }
+                        block.nbSamples = samples;
+                    }
+                    pcmIndex_ += samples;
+                    continue;
+                }
+                inputEof_ = true;
+            }
+
+            int r = inputEof_ ? AVERROR_EOF : readFrame();
+
+            // If some non-zero sample size of the input frame is successfully decoded 
+            if (r != AVERROR_EOF && frame_->nb_samples > 0)
+            {
+                // If the current channel's layout id is different than the one specified in the input codec
+                if (frame_->ch_layout.nb_channels != codec_->ch_layout.nb_channels)
+                {
+                    // Oh, the channel layout can dynamically change in the middle lol
+                    throw MPError("channel layout had changed in the middle");
+                }
+
+                if (rebase_)
+                {
+                    rebase_ = false;
+                    auto pts = frame_->pts != AV_NOPTS_VALUE ? frame_->pts : frame_->best_effort_timestamp;
+                    if (pts == AV_NOPTS_VALUE) throw MPError("no timestamps to position the input");
+
+                    auto startTime = audioStream_->start_time != AV_NOPTS_VALUE ? audioStream_->start_time : 0;
+                    position_ = av_rescale_q(pts - startTime, audioStream_->time_base, AVRational { 1, filterSampleRate_ });
+                }
+
+                // This is the input music file's decoded raw frame
+                int nb_samples = frame_->nb_samples;
+
+                // If the input music file is NOT in the format we want (44kHz stereo, signe 16 bits, planar)
+                if (swr_)
+                {
+                    // An upper bound on the number of samples that the next swr_convert will output
+                    auto swrOutSamples = swr_get_out_samples(swr_, nb_samples);
+
+                    // The block keeps the maximum number of samples across all decoded raw frames of the input music file
+                    block.reserve(swrOutSamples, filterSampleBytes_, interleaved_);
+
+                    // Convert the input music file's decoded raw frame to be our desired format (signed 16-bits, planar, 44100 fps)
+                    block.nbSamples = swr_convert(swr_, block.data.data(), swrOutSamples, (const uint8_t **)frame_->data, nb_samples);
+                    if (block.nbSamples < 0) throw MPError("failed to convert input samples", block.nbSamples);
+                }
+                else if (convert_)
+                {
+                    block.reserve(nb_samples, filterSampleBytes_, interleaved_);
+                    convert_(frame_->data, block.data.data(), nb_samples);
+                    block.nbSamples = nb_samples;
+                }
+                // If the input music file is in the format we want
+                else if (canBorrow && !addNoise)
+                {
+                    if (interleaved_)
+                        block.borrow(frame_->data[0], frame_->data[0] + filterSampleBytes_, nb_samples, 2);
+                    else
+                        block.borrow(frame_->data[0], frame_->data[1], nb_samples, 1);
+                }
+                else
+                {
+                    block.reserve(nb_samples, filterSampleBytes_, interleaved_);
+                    if (interleaved_)
+                    {
+                        std::copy_n(frame_->data[0], nb_samples * filterSampleBytes_ * 2, block.data[0]);
+                    }
+                    else
+                    {
+                        std::copy_n(frame_->data[0], nb_samples * filterSampleBytes_, block.data[0]);
+                        std::copy_n(frame_->data[1], nb_samples * filterSampleBytes_, block.data[1]);
+                    }
+                    block.nbSamples = nb_samples;
+                }
+
+                if (pcmWriter_)
+                {
+                    pcmWriter_->append(block.data[0], block.data[1], block.nbSamples, block.step, position_);
+                }
+            }
+            else
+            {
+                if (pcmWriter_)
+                {
+                    pcmWriter_->finish();
+                    pcmWriter_.reset();
+                }
+                inputEof_ = true;
+                if (silenceLeft_ == 0)
+                {
+                    return false;
+                }
+
+                // in blocks of a bounded size, the blocks and the encoder frames made for them would be
+                //  as long as the silence otherwise
+                const int silence = std::min(silenceLeft_, MaxSilenceBlock);
+                block.reserve(silence, filterSampleBytes_, interleaved_);
+                av_samples_set_silence(block.data.data(), /*offset=*/0, silence, 2, filterFormat_);
+                block.nbSamples = silence;
+                silenceLeft_ -= silence;
+            }
+        }
+
+        block.position = position_;
+        position_ += block.nbSamples;
+        samplesDecoded().fetch_add(block.nbSamples, std::memory_order_relaxed);
+
+        if (addNoise)
+        {
+            addDenormalNoise((float *)block.data[0], (float *)block.data[1], block.nbSamples, block.step, block.position);
+        }
+        return true;
+    }
+
+    // Filter stage: run the filters [first, last) of the chain in place over the block.
+    // The block is taken tile by tile, each tile goes through all the filters while it is in L1
+    void dsp(SampleBlock & block, size_t first = 0, size_t last = std::numeric_limits<size_t>::max())
+    {
+        std::visit([&block, first, last, tile = tileSamples_, denormals = denormals_] (auto && fs)
+                   {
+                       using sample_t = typename std::decay_t<decltype(fs)>::value_type::element_type::sample_t;
+
+                       auto end = std::min(last, fs.size());
+                       if (first >= end)
+                       {
+                           return;
+                       }
+
+                       ScopedFlushDenormals ftz(std::is_floating_point_v<sample_t> && denormals == DenormalMode::Flush);
+
+                       auto lbSrc = (const sample_t *)block.data[0];
+                       auto rbSrc = (const sample_t *)block.data[1];
+                       // a borrowed decoder frame is not ours to write, the first filter outputs to the block's own planes
+                       if (block.isBorrowed())
+                       {
+                           block.reserve(block.nbSamples, sizeof(sample_t), block.step == 2);
+                       }
+                       auto lbDst = (sample_t *)block.data[0];
+                       auto rbDst = (sample_t *)block.data[1];
+
+                       for (int offset = 0; offset < block.nbSamples; offset += tile)
+                       {
+                           const int count = std::min(tile, block.nbSamples - offset);
+                           const size_t at = size_t(offset) * block.step;
+
+                           auto lbIn = lbSrc + at;
+                           auto rbIn = rbSrc + at;
+                           auto lbOut = lbDst + at;
+                           auto rbOut = rbDst + at;
+                           for (auto i = first; i < end; ++i)
+                           {
+                               fs[i]->filter(lbIn, rbIn, lbOut, rbOut, count, block.step);
+                               lbIn = lbOut;
+                               rbIn = rbOut;
+                           }
+                       }
+                   }, filters_);
+    }
+
+    // Time each filter over a second of noise. A scratch chain is used, the live filter states stay untouched
+    std::vector<double> filterCosts() const
+    {
+        auto chain = newChain();
+        std::vector<double> costs;
+        std::visit([this, &costs] (auto && fs)
+                   {
+                       using sample_t = typename std::decay_t<decltype(fs)>::value_type::element_type::sample_t;
+
+                       std::vector<sample_t> lb(filterSampleRate_), rb(filterSampleRate_);
+                       uint32_t seed = 1;
+                       for (int i = 0; i < filterSampleRate_; i++)
+                       {
+                           // half scale white noise keeps every filter on its regular path
+                           seed = seed * 1664525u + 1013904223u;
+                           float v = int32_t(seed) / 4294967296.f;
+                           if constexpr (std::is_floating_point_v<sample_t>)
+                           {
+                               lb[i] = v;
+                               rb[i] = -v;
+                           }
+                           else
+                           {
+                               lb[i] = sample_t(v * std::numeric_limits<sample_t>::max());
+                               rb[i] = -lb[i];
+                           }
+                       }
+
+                       for (auto & filter : fs)
+                       {
+                           filter->setSamplerate(filterSampleRate_);
+                           auto start = std::chrono::steady_clock::now();
+                           filter->filter(lb.data(), rb.data(), lb.data(), rb.data(), filterSampleRate_);
+                           costs.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+                       }
+                   }, chain);
+        return costs;
+    }
+
+private:
+    FilterChain newChain() const
+    {
+        switch (av_get_packed_sample_fmt(filterFormat_))
+        {
+        case AV_SAMPLE_FMT_FLT:
+            if (fab_.singlePrecision())
+            {
+                return fab_.create<float, float>();
+            }
+            return fab_.create<float, double>();
+        case AV_SAMPLE_FMT_S16:
+            return fab_.create<int16_t, int32_t>();
+        default:
+            return fab_.create<int32_t, int64_t>();
+        }
+    }
+
+    // Sources with no more than 16 bits per sample
+    static bool isSixteenBit(const AVCodecContext * codec)
+    {
+        switch (av_get_packed_sample_fmt(codec->sample_fmt))
+        {
+        case AV_SAMPLE_FMT_U8:
+        case AV_SAMPLE_FMT_S16:
+            return true;
+        case AV_SAMPLE_FMT_S32:
+            // some decoders put 16-bit samples into 32 bits
+            return codec->bits_per_raw_sample > 0 && codec->bits_per_raw_sample <= 16;
+        default:
+            return false;
+        }
+    }
+
+    void createFilters()
+    {
+        // the filters and the states their setSamplerate makes go into one block, in the order of the chain
+        StateArena::Scope arena;
+        filters_ = newChain();
+
+        filterSampleRate_ = codec_->sample_rate;
+
+        std::visit([this] (auto && filters)
+                   {
+                       for (auto & filter : filters)
+                       {
+                           filterSampleRate_ = filter->agreeSamplerate(filterSampleRate_);
+                       }
+                       for (auto & filter : filters)
+                       {
+                           filter->setSamplerate(filterSampleRate_);
+                       }
+                       for (size_t i = 0; i < normalizers_.size(); i++)
+                       {
+                           filters[i]->setNormFactor(normalizers_[i]);
+                       }
+                   }, filters_);
+    }
+
+    // Read packets until the next audio frame is decoded into frame_, returns AVERROR_EOF at the end of the input.
+    // The decoder is drained before every read as a packet may hold several frames (MP3, AAC, WMA ...)
+    int readFrame()
+    {
+        while (true)
+        {
+            // <TIP: get a raw frame from the input music file with a proper codec-decoding>
+            // <FLOW: AVFormatContext (avfmt_) -> AVPacket (packet_) -> AVCodexContext (codec_) 
+            //   -> AVFrame (frame_) >
+            int r = avcodec_receive_frame(codec_, frame_);
+            if (r == 0 || r == AVERROR_EOF)
+            {
+                return r;
+            }
+            else if (r != AVERROR(EAGAIN))
+            {
+                throw MPError("failed to receive frame", r);
+            }
+            else if (draining_)
+            {
+                return AVERROR_EOF;
+            }
+
+            // Read an encoded frame from the input music file
+            r = av_read_frame(avfmt_, packet_);
+            if (r != 0)
+            {
+                // no more packets, collect the frames the decoder still holds
+                draining_ = true;
+                r = avcodec_send_packet(codec_, NULL);
+                if (r != 0 && r != AVERROR_EOF)
+                {
+                    throw MPError("failed to flush decoder", r);
+                }
+                continue;
+            }
+
+            // The cover image was written with the output header (from the stream's attached_pic), this may run
+            //  on the decode stage of a pipeline which must not touch the output
+            if (imageStream_ && (imageStream_->index == packet_->stream_index))
+            {
+                av_packet_unref(packet_);
+                continue;
+            }
+            // unknown stream index
+            if (audioStream_->index != packet_->stream_index)
+            {
+                av_packet_unref(packet_);
+                continue;
+            }
+
+            // If this frame is an audio frame, send it to the input audioc codec (codec_) to decode it 
+            r = avcodec_send_packet(codec_, packet_);
+            av_packet_unref(packet_);
+            if (r == 0)
+            {
+                continue;
+            }
+            else if (r == AVERROR_INVALIDDATA
+                     && (codec_->codec_id == AV_CODEC_ID_MP3
+                         || codec_->codec_id == AV_CODEC_ID_WMAV1 || codec_->codec_id == AV_CODEC_ID_WMAV2))
+            {
+                // MP3 https://trac.ffmpeg.org/ticket/7879
+            }
+            else if (r == AVERROR(EPERM)
+                     && (codec_->codec_id == AV_CODEC_ID_WMAV1 || codec_->codec_id == AV_CODEC_ID_WMAV2))
+            {
+                // WMA https://trac.ffmpeg.org/ticket/9358
+            }
+            else
+            {
+                throw MPError("failed to send packet (input)", r);
+            }
+        }
+    }
+
+    const FilterFabric &        fab_;
+    const std::vector<float>    normalizers_;
+
+    scoped_ptr<AVFormatContext> avfmt_ { nullptr, [] (AVFormatContext * d) { avformat_close_input(&d); } };
+    AVStream *                  audioStream_ = nullptr;
+    AVStream *                  imageStream_ = nullptr;
+    scoped_ptr<AVCodecContext>  codec_ { nullptr, [] (AVCodecContext * d) {} };
+    scoped_ptr<AVCodecContext>  imageCodec_ { nullptr, [] (AVCodecContext * d) {} };
+    scoped_ptr<SwrContext>      swr_ { nullptr, [] (SwrContext * d) { swr_free(&d); } };
+    ConvertKernel               convert_ = nullptr;
+    scoped_ptr<AVFrame>         frame_ { nullptr, [] (AVFrame * d) { av_frame_free(&d); } };
+    scoped_ptr<AVPacket>        packet_ { nullptr, [] (AVPacket * d) { av_packet_free(&d); } };
+
+    AVSampleFormat              filterFormat_ = AV_SAMPLE_FMT_NONE;
+    bool                        interleaved_ = false;
+    int                         tileSamples_ = 0;
+    DenormalMode                denormals_ = DenormalMode::Flush;
+    int                         filterSampleBytes_ = 0;
+    int                         filterSampleRate_ = 0;
+    FilterChain                 filters_;
+
+    int64_t                     position_ = 0;
+    bool                        rebase_ = false;
+    bool                        inputEof_ = false;
+    bool                        draining_ = false;
+    int                         silenceSamples_ = 0;
+    int                         silenceLeft_ = 0;
+
+    std::unique_ptr<PcmCache::Reader>   pcm_;
+    int64_t                             pcmIndex_ = 0;
+    std::unique_ptr<PcmCache::Writer>   pcmWriter_;
+};
+
+
+// Files that run the same chain are filtered in lockstep, each file in one lane of the filters' lane kernels.
+// Every worker hands its block to its lane of a group, the worker completing the group runs the chain over all of them
+class LaneScheduler
+{
+    struct Slot
+    {
+        // null for a free lane
+        FilterChain *   filters = nullptr;
+        int             tile = 0;
+        // the block waiting to be filtered and how far the filters got, null while the worker decodes and encodes
+        SampleBlock *   block = nullptr;
+        int             offset = 0;
+    };
+
+    struct Group
+    {
+        size_t              chainType;
+        std::vector<Slot>   slots;
+        int                 active = 0;
+        int                 pending = 0;
+        bool                running = false;
+    };
+
+public:
+    LaneScheduler(int lanes, DenormalMode denormals)
+        : lanes_(std::clamp(lanes, 2, Filter<float, double>::MaxLanes))
+        , denormals_(denormals)
+    {}
+
+    // A lane taken for the duration of a file
+    class Ticket
+    {
+        Ticket(const Ticket &) = delete;
+        Ticket operator=(const Ticket &) = delete;
+    public:
+        Ticket(LaneScheduler & scheduler, FilterChain & filters, int tile)
+            : scheduler_(scheduler)
+        {
+            scheduler_.join(*this, filters, tile);
+        }
+        ~Ticket()
+        {
+            scheduler_.leave(*this);
+        }
+
+        // Filter the block in place together with the blocks of the other lanes, returns once it is done
+        void dsp(SampleBlock & block)
+        {
+            scheduler_.filter(*this, block);
+        }
+
+    private:
+        friend class LaneScheduler;
+        LaneScheduler & scheduler_;
+        Group *         group_ = nullptr;
+        size_t          slot_ = 0;
+    };
+
+private:
+    void join(Ticket & ticket, FilterChain & filters, int tile)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        for (auto & group : groups_)
+        {
+            if (group.chainType != filters.index() || group.active == lanes_)
+            {
+                continue;
+            }
+            for (size_t i = 0; i < group.slots.size(); i++)
+            {
+                if (!group.slots[i].filters)
+                {
+                    take(group, i, ticket, filters, tile);
+                    return;
+                }
+            }
+        }
+
+        auto & group = groups_.emplace_back();
+        group.chainType = filters.index();
+        group.slots.resize(lanes_);
+        take(group, 0, ticket, filters, tile);
+    }
+
+    void take(Group & group, size_t slot, Ticket & ticket, FilterChain & filters, int tile)
+    {
+        group.slots[slot] = Slot { &filters, tile };
+        ++group.active;
+        ticket.group_ = &group;
+        ticket.slot_ = slot;
+    }
+
+    void leave(Ticket & ticket)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        auto & group = *ticket.group_;
+        group.slots[ticket.slot_] = Slot {};
+        if (--group.active == 0)
+        {
+            groups_.remove_if([&group] (const Group & g) { return &g == &group; });
+        }
+        // the others may be complete without this lane now
+        cv_.notify_all();
+    }
+
+    void filter(Ticket & ticket, SampleBlock & block)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        auto & group = *ticket.group_;
+        auto & slot = group.slots[ticket.slot_];
+        slot.block = &block;
+        slot.offset = 0;
+        ++group.pending;
+
+        while (slot.block)
+        {
+            if (!group.running && group.pending == group.active)
+            {
+                run(group, lock);
+            }
+            else
+            {
+                cv_.wait(lock);
+            }
+        }
+    }
+
+    // Advance all lanes until the block of one of them is done, the filtering itself runs unlocked
+    void run(Group & group, std::unique_lock<std::mutex> & lock)
+    {
+        group.running = true;
+
+        std::vector<Slot *> lanes;
+        int tile = std::numeric_limits<int>::max();
+        for (auto & slot : group.slots)
+        {
+            if (slot.block)
+            {
+                lanes.push_back(&slot);
+                tile = std::min(tile, slot.tile);
+            }
+        }
+
+        lock.unlock();
+
+        bool done = false;
+        while (!done)
+        {
+            int count = tile;
+            for (auto * slot : lanes)
+            {
+                count = std::min(count, slot->block->nbSamples - slot->offset);
+            }
+
+            std::visit([this, &lanes, count] (auto && chain)
+                       {
+                           using Chain = std::decay_t<decltype(chain)>;
+                           using FilterType = typename Chain::value_type::element_type;
+                           using sample_t = typename FilterType::sample_t;
+
+                           ScopedFlushDenormals ftz(std::is_floating_point_v<sample_t> && denormals_ == DenormalMode::Flush);
+
+                           typename FilterType::Lane filterLanes[FilterType::MaxLanes];
+                           for (size_t f = 0; f < chain.size(); f++)
+                           {
+                               for (size_t k = 0; k < lanes.size(); k++)
+                               {
+                                   auto & block = *lanes[k]->block;
+                                   const size_t at = size_t(lanes[k]->offset) * block.step;
+                                   filterLanes[k] = { std::get<Chain>(*lanes[k]->filters)[f].get(),
+                                                      (sample_t *)block.data[0] + at, (sample_t *)block.data[1] + at, block.step };
+                               }
+                               filterLanes[0].filter->filterLanes(filterLanes, int(lanes.size()), count);
+                           }
+                       }, *lanes.front()->filters);
+
+            for (auto * slot : lanes)
+            {
+                slot->offset += count;
+                done |= slot->offset == slot->block->nbSamples;
+            }
+        }
+
+        lock.lock();
+
+        for (auto * slot : lanes)
+        {
+            if (slot->offset == slot->block->nbSamples)
+            {
+                slot->block = nullptr;
+                --group.pending;
+            }
+        }
+        group.running = false;
+        cv_.notify_all();
+    }
+
+    const int               lanes_;
+    const DenormalMode      denormals_;
+    std::mutex              mutex_;
+    std::condition_variable cv_;
+    std::list<Group>        groups_;
+};
+
+
+// Split the chain into at most `stages` contiguous groups so that the costliest group is as cheap as possible.
+// Returns the group boundaries: 0, ..., costs.size()
+static std::vector<size_t> balanceStages(const std::vector<double> & costs, int stages)
+{
+    const size_t n = costs.size();
+    const size_t k = std::max<size_t>(1, std::min<size_t>(stages, n));
+
+    std::vector<double> prefix(n + 1, 0.);
+    for (size_t i = 0; i < n; i++)
+    {
+        prefix[i + 1] = prefix[i] + costs[i];
+    }
+
+    // best[g][i]: the costliest group when the first i filters make g + 1 groups, cut[g][i]: where the last one starts
+    std::vector<std::vector<double>> best(k, std::vector<double>(n + 1, std::numeric_limits<double>::max()));
+    std::vector<std::vector<size_t>> cut(k, std::vector<size_t>(n + 1, 0));
+    for (size_t i = 0; i <= n; i++)
+    {
+        best[0][i] = prefix[i];
+    }
+    for (size_t g = 1; g < k; g++)
+    {
+        for (size_t i = g + 1; i <= n; i++)
+        {
+            for (size_t j = g; j < i; j++)
+            {
+                auto cost = std::max(best[g - 1][j], prefix[i] - prefix[j]);
+                if (cost < best[g][i])
+                {
+                    best[g][i] = cost;
+                    cut[g][i] = j;
+                }
+            }
+        }
+    }
+
+    std::vector<size_t> bounds(k + 1);
+    bounds[k] = n;
+    for (size_t g = k - 1; g > 0; g--)
+    {
+        bounds[g] = cut[g][bounds[g + 1]];
+    }
+    bounds[0] = 0;
+    return bounds;
+}
+
+
+// Raw block files carry the filtered samples of a segment until the encoder gets to them
+// The samples are kept in the filter layout: one run of interleaved pairs or the left then the right plane
+static void writeBlock(std::ofstream & os, const SampleBlock & block, int first, int count, int sampleBytes)
+{
+    os.write((const char *)&count, sizeof(count));
+    const size_t planeBytes = size_t(count) * sampleBytes * block.step;
+    for (size_t c = 0; c < (block.step == 2 ? 1 : block.data.size()); c++)
+    {
+        os.write((const char *)block.data[c] + size_t(first) * sampleBytes * block.step, planeBytes);
+    }
+    if (!os) throw MPError("failed to write segment data");
+}
+
+static bool readBlock(std::ifstream & is, SampleBlock & block, int sampleBytes, bool interleaved)
+{
+    int count = 0;
+    if (!is.read((char *)&count, sizeof(count)))
+    {
+        return false;
+    }
+    block.reserve(count, sampleBytes, interleaved);
+    const size_t planeBytes = size_t(count) * sampleBytes * block.step;
+    for (size_t c = 0; c < (interleaved ? 1 : block.data.size()); c++)
+    {
+        if (!is.read((char *)block.data[c], planeBytes)) throw MPError("truncated segment data");
+    }
+    block.nbSamples = count;
+    return true;
+}
+
+// Filter [start, end) filter-rate samples of the input into a raw block file.
+// Decoding starts warmup samples earlier so that the filter states converge, the output of the warm-up is dropped
+static void renderSegment(MediaInput & input, int64_t start, int64_t end, int64_t warmup, const std::filesystem::path & raw)
+{
+    std::ofstream os(raw, std::ios::binary | std::ios::trunc);
+    if (!os) throw MPError("failed to create segment file");
+
+    const int sampleBytes = av_get_bytes_per_sample(input.filterFormat());
+
+    SampleBlock block;
+    if (start <= 0)
+    {
+        if (!input.decode(block, true))
+        {
+            return;
+        }
+    }
+    else
+    {
+        // a step back of at least a codec frame (or a tenth of a second), a seek lands at frame boundaries
+        const int frameSize = input.codec()->frame_size > 0
+            ? int(av_rescale(input.codec()->frame_size, input.filterSampleRate(), std::max(1, input.codec()->sample_rate)))
+            : 0;
+        const int64_t backoff = std::max<int64_t>({ warmup, frameSize, input.filterSampleRate() / 10 });
+        for (int64_t from = start - warmup; ; from -= backoff)
+        {
+            input.seek(from);
+            if (!input.decode(block, true))
+            {
+                return;
+            }
+            // seeking is not sample exact with every format, step back until the whole warm-up is covered
+            if (block.position <= std::max<int64_t>(0, from) || from <= 0)
+            {
+                break;
+            }
+        }
+    }
+
+    do
+    {
+        input.dsp(block);
+
+        auto first = std::max(block.position, start);
+        auto last = std::min(block.position + block.nbSamples, end);
+        if (last > first)
+        {
+            writeBlock(os, block, int(first - block.position), int(last - first), sampleBytes);
+        }
+        if (block.position + block.nbSamples >= end)
+        {
+            break;
+        }
+    } while (input.decode(block, true));
+}
+
+// Reads the raw block files of the segments back as one stream
+class SegmentReader
+{
+public:
+    SegmentReader(const std::vector<std::filesystem::path> & raws, int sampleBytes, bool interleaved)
+        : raws_(raws)
+        , sampleBytes_(sampleBytes)
+        , interleaved_(interleaved)
+    {}
+
+    bool next(SampleBlock & block)
+    {
+        while (!is_.is_open() || !readBlock(is_, block, sampleBytes_, interleaved_))
+        {
+            is_.close();
+            if (segment_ == raws_.size())
+            {
+                return false;
+            }
+            is_.open(raws_[segment_++], std::ios::binary);
+        }
+        return true;
+    }
+
+private:
+    const std::vector<std::filesystem::path> & raws_;
+    const int       sampleBytes_;
+    const bool      interleaved_;
+    size_t          segment_ = 0;
+    std::ifstream   is_;
+};
+
+// Decode and filter the whole input sequentially and tell how far the spliced segments are from it
+static void verifySegments(MediaInput & input, const std::vector<std::filesystem::path> & raws, const std::string & name)
+{
+    std::visit([&] (auto && fs)
+               {
+                   using sample_t = typename std::decay_t<decltype(fs)>::value_type::element_type::sample_t;
+                   const double scale = std::is_floating_point_v<sample_t> ? 1. : double(std::numeric_limits<sample_t>::max());
+
+                   SegmentReader reader(raws, sizeof(sample_t), input.interleaved());
+                   SampleBlock sequential, spliced;
+                   int seqOffset = 0, splicedOffset = 0;
+
+                   auto nextSequential = [&] ()
+                   {
+                       while (seqOffset == sequential.nbSamples)
+                       {
+                           if (!input.decode(sequential, true))
+                           {
+                               return false;
+                           }
+                           input.dsp(sequential);
+                           seqOffset = 0;
+                       }
+                       return true;
+                   };
+                   auto nextSpliced = [&] ()
+                   {
+                       while (splicedOffset == spliced.nbSamples)
+                       {
+                           if (!reader.next(spliced))
+                           {
+                               return false;
+                           }
+                           splicedOffset = 0;
+                       }
+                       return true;
+                   };
+
+                   int64_t samples = 0, differing = 0, worstAt = 0;
+                   double maxError = 0., sumError = 0.;
+                   bool haveSequential, haveSpliced;
+                   while ((haveSequential = nextSequential()) & (haveSpliced = nextSpliced()))
+                   {
+                       auto count = std::min(sequential.nbSamples - seqOffset, spliced.nbSamples - splicedOffset);
+                       for (size_t c = 0; c < sequential.data.size(); c++)
+                       {
+                           auto a = (const sample_t *)sequential.data[c] + seqOffset * sequential.step;
+                           auto b = (const sample_t *)spliced.data[c] + splicedOffset * spliced.step;
+                           for (int i = 0; i < count; i++)
+                           {
+                               auto e = std::abs(double(a[i * sequential.step]) - double(b[i * spliced.step])) / scale;
+                               if (e > 0.)
+                               {
+                                   ++differing;
+                               }
+                               if (e > maxError)
+                               {
+                                   maxError = e;
+                                   worstAt = samples + i;
+                               }
+                               sumError += e * e;
+                           }
+                       }
+                       seqOffset += count;
+                       splicedOffset += count;
+                       samples += count;
+                   }
 
-    if ((r = av_audio_fifo_realloc(fifo, av_audio_fifo_size(fifo) + nbSamples)) < 0)
-        throw MPError("failed to resize fifo");
+                   // the rest of the longer stream has nothing to compare with
+                   int64_t lengthDiff = 0;
+                   for (; haveSequential; haveSequential = nextSequential())
+                   {
+                       lengthDiff += sequential.nbSamples - seqOffset;
+                       seqOffset = sequential.nbSamples;
+                   }
+                   for (; haveSpliced; haveSpliced = nextSpliced())
+                   {
+                       lengthDiff -= spliced.nbSamples - splicedOffset;
+                       splicedOffset = spliced.nbSamples;
+                   }
 
-    if (av_audio_fifo_write(fifo, buffers, nbSamples) < nbSamples)
-        throw MPError("failed to write to fifo");
+                   auto dB = [] (double v) { return v > 0. ? 20. * std::log10(v) : -INFINITY; };
+                   msg() << name << " - segments vs sequential: " << samples << " samples, " << differing << " differ, max error "
+                       << dB(maxError) << " dBFS at " << double(worstAt) / input.filterSampleRate() << "s, rms error "
+                       << dB(samples ? std::sqrt(sumError / (2. * samples)) : 0.) << " dBFS, length difference " << lengthDiff;
+               }, input.filters());
 }
 
-//
-
-template<typename sample_t>
-struct FType0
+MediaProbe probeMedia(const std::filesystem::path & input)
 {
-    std::vector<sample_t> lb, rb;
-    sample_t * lbIn, * rbIn;
-    std::vector<sample_t> lbOut, rbOut;
-
-    FType0()
+    MediaProbe probe;
+    AVFormatContext * ctx = nullptr;
+    if (avformat_open_input(&ctx, input.string().c_str(), NULL, NULL) != 0)
     {
-        lbIn = lb.data();
-        rbIn = rb.data();
+        return probe;
     }
+    scoped_ptr<AVFormatContext> avfmt(ctx, [] (AVFormatContext * d) { avformat_close_input(&d); });
 
-    void resizeIn(size_t size)
+    // the streams are not read, the header either has it or it does not
+    if (avfmt->duration != AV_NOPTS_VALUE && avfmt->duration > 0)
+    {
+        probe.seconds = double(avfmt->duration) / AV_TIME_BASE;
+    }
+    for (unsigned i = 0; i < avfmt->nb_streams; i++)
     {
-        if (lb.size() < size)
+        auto stream = avfmt->streams[i];
+        if (stream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO)
         {
-            lb.resize(size);
-            lbIn = lb.data();
+            continue;
         }
-        if (rb.size() < size)
+        if (probe.seconds == 0 && stream->duration != AV_NOPTS_VALUE && stream->duration > 0)
         {
-            rb.resize(size);
-            rbIn = rb.data();
+            probe.seconds = stream->duration * av_q2d(stream->time_base);
+        }
+        if (probe.sampleRate == 0 && stream->codecpar->sample_rate > 0)
+        {
+            probe.sampleRate = stream->codecpar->sample_rate;
+            probe.frameSize = stream->codecpar->frame_size;
         }
     }
-
-    void resizeOut(size_t size)
-    {
-        if (lbOut.size() < size) lbOut.resize(size);
-        if (rbOut.size() < size) rbOut.resize(size);
-    }
-
-    std::array<uint8_t *, 2> buffersIn() const
-    {
-        return { (uint8_t *)lb.data(), (uint8_t *)rb.data() };
-    }
-
-    std::array<uint8_t *, 2> buffersOut() const
-    {
-        return { (uint8_t *)lbOut.data(), (uint8_t *)rbOut.data() };
-    }
-
-    void buffersExt(uint8_t * d0, uint8_t * d1, int samples)
-    {
-        lbIn = (sample_t *)d0;
-        rbIn = (sample_t *)d1;
-
-        // Prepare room for the filter
-        if (lb.size() < samples) lb.resize(samples);
-        if (rb.size() < samples) rb.resize(samples);
-    }
-
-    template<typename Filter, std::enable_if_t<std::is_same_v<typename Filter::sample_t, sample_t>, bool> = true>
-    void run(Filter & filter, int samples)
-    {
-        filter.filter(lbIn, rbIn, lbOut.data(), rbOut.data(), samples);
-    }
-
-    template<typename Filter, std::enable_if_t<!std::is_same_v<typename Filter::sample_t, sample_t>, bool> = true>
-    void run(Filter & filter, int samples)
-    {}
-
-    void swap()
-    {
-        lb.swap(lbOut);
-        rb.swap(rbOut);
-        lbIn = lb.data();
-        rbIn = rb.data();
-    }
-};
-
-//
+    return probe;
+}
 
 #if defined(_WIN32)
 std::wstring
@@ -289,13 +1467,16 @@ MediaProcess::operator()(const FileItem & item) const
 {
     try
     {
-        process(item);
+        uint64_t content = 0;
+        const bool cached = process(item, content);
+        finished(item, true, content);
         // libc cannot into wstring https://gcc.gnu.org/bugzilla/show_bug.cgi?id=102839
     #if defined(_WIN32)
-        return item.output.wstring() + L" (FINISHED)";
+        return item.output.wstring() + (cached ? L" (CACHED)" : L" (FINISHED)");
     }
     catch (const MPError & e)
     {
+        finished(item, false);
         if (e.isError())
         {
             return item.output.wstring() + L" failed : " + stringToWstring(e.what());
@@ -307,13 +1488,15 @@ MediaProcess::operator()(const FileItem & item) const
     }
     catch (const std::exception & e)
     {
+        finished(item, false);
         return item.output.wstring() + L" exception : " + stringToWstring(e.what());
     }
     #else
-        return item.output.string() + " (FINISHED)";
+        return item.output.string() + (cached ? " (CACHED)" : " (FINISHED)");
     }
     catch (const MPError & e)
     {
+        finished(item, false);
         if (e.isError())
         {
             return item.output.string() + " failed : " + e.what();
@@ -325,160 +1508,175 @@ MediaProcess::operator()(const FileItem & item) const
     }
     catch (const std::exception & e)
     {
+        finished(item, false);
         return item.output.string() + " exception : " + e.what();
     }
 #endif
 }
 
 
-void MediaProcess::process(const FileItem & item) const
+void MediaProcess::finished(const FileItem & item, bool written, uint64_t content) const
 {
-    std::vector<float> normalizers;
-    bool ripped = false;
-    do {
-        if (!do_process(item, normalizers, ripped))
-            break;
-    } while (ripped);
+    if (options_.finished)
+    {
+        options_.finished(item, written, content);
+    }
 }
 
 
-bool MediaProcess::do_process(const FileItem & item, std::vector<float> & normalizers, bool & ripped) const
+MediaProcess::MediaProcess(const FilterFabric & fab, const ProcessOptions & options)
+    : filterFab_(fab)
+    , options_(options)
 {
-    //#if defined(_DEBUG)
-    //    msg() << item.output.string();
-    //#endif // defined(_DEBUG)
-    bool normalize = item.normalize;
-
-    std::filesystem::create_directories(item.output.parent_path());
+    if (options_.lanes > 1)
+    {
+        laneScheduler_ = std::make_shared<LaneScheduler>(options_.lanes, options_.denormals);
+    }
+    if (options_.maxMemory > 0)
+    {
+        memoryBudget_ = std::make_shared<MemoryBudget>(options_.maxMemory);
+    }
+    if (!options_.cache.empty())
+    {
+        outputCache_ = std::make_shared<OutputCache>(options_.cache, chainDescription(filterFab_, options_), options_.cacheBytes);
+    }
+    if (!options_.pcmCache.empty())
+    {
+        pcmCache_ = std::make_shared<PcmCache>(options_.pcmCache, options_.pcmCacheBytes);
+    }
+}
 
-    std::filesystem::path tempOut(item.output);
-    tempOut += ".tmp";
 
-    int r;
+std::wstring chainDescription(const FilterFabric & fab, const ProcessOptions & options)
+{
+    return fab.description() + L";denormals=" + stringToWstring(denormalModeName(options.denormals));
+}
 
-    scoped_ptr<AVFormatContext> avfmt_in([&item] ()
-                                         {	// open the input music file
-                                             AVFormatContext * ctx = nullptr;
-                                             int r = avformat_open_input(&ctx, item.input.string().c_str(), NULL, NULL);
-                                             if (r != 0) throw MPError("failed to open input media", r);
-                                             return ctx;
-                                         }(),
-                                             [] (auto * d)
-                                         {
-                                             avformat_close_input(&d);/* avformat_free_context(d); */
-                                         });
-
-    // ensure a stream exists in the input music file
-    if ((r = avformat_find_stream_info(avfmt_in, NULL)) < 0)
-        throw MPError("no media stream", r);
 
-    //
-    //av_dump_format(avfmt_in, 0, "*", false);
-    //
+// The memory a file takes while it is processed: the states and the sample blocks of its filter chains (one
+// per segment), with the decoders and the encoder. Blocks hold at most a decoded frame or a block of silence.
+// The header is read again only for a file the scan did not probe
+size_t MediaProcess::footprint(const FileItem & item) const
+{
+    // the codecs, their frames and the I/O buffers of the containers
+    static constexpr size_t CodecBytes = 4 << 20;
 
-    AVStream * audioStream = 0;
-    AVStream * imageStream = 0;
-    for (int i = 0; i < avfmt_in->nb_streams; i++)
+    int sampleRate = item.sampleRate;
+    int frameSize = item.frameSize;
+    if (sampleRate <= 0)
     {
-        auto & stream = avfmt_in->streams[i];
-
-        // there might be several attaches pic streams, so we pick the last?
-        if (stream->disposition & AV_DISPOSITION_ATTACHED_PIC)
-        {
-            imageStream = stream;
-        }
+        const MediaProbe probe = probeMedia(item.input);
+        sampleRate = probe.sampleRate > 0 ? probe.sampleRate : 48000;
+        frameSize = probe.frameSize;
+    }
 
-        if (stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
-        {
-            if (audioStream) throw MPError("using multiple audio streams is not supported");
+    const size_t block = size_t(std::max(frameSize, MaxSilenceBlock)) * 2 * sizeof(float);
+    // a pipelined file has its queues full of blocks, a sequential one the decoded, the filtered and the encoded block
+    const size_t blocks = options_.pipeline ? 8 + 2 * size_t(options_.filterStages) : 3;
+    const size_t chain = chainStateBytes(sampleRate) + blocks * block + CodecBytes;
+    return size_t(std::max(1, options_.segments)) * chain + CodecBytes;
+}
 
-            audioStream = stream;
-        }
+size_t MediaProcess::chainStateBytes(int sampleRate) const
+{
+    std::lock_guard lock(stateBytesMtx_);
+    auto found = stateBytes_.find(sampleRate);
+    if (found != stateBytes_.end())
+    {
+        return found->second;
     }
-    if (!audioStream) throw MPError("no audio stream is found");
 
-    auto audioCodecIn = createCodec(audioStream->codecpar);
-    const int srcChannels = audioCodecIn->ch_layout.nb_channels;
-    auto imageCodecIn = createCodec(imageStream ? imageStream->codecpar : nullptr);
+    // the float chain, its double states are the widest
+    StateArena::Scope arena;
+    auto filters = filterFab_.create<float, double>();
+    int filterSampleRate = sampleRate;
+    for (auto & filter : filters)
+    {
+        filterSampleRate = filter->agreeSamplerate(filterSampleRate);
+    }
+    for (auto & filter : filters)
+    {
+        filter->setSamplerate(filterSampleRate);
+    }
+    return stateBytes_[sampleRate] = arena.bytes();
+}
 
-    // *** Set up the input format ctx ***
 
-    std::variant<
-        // ! update filterFormat and params.codec_id !
-        //std::vector<std::unique_ptr<Filter<int16_t, int32_t>>>,
-        std::vector<std::unique_ptr<Filter<int32_t, int64_t>>>,
-        std::vector<std::unique_ptr<Filter<float, double>>>
-    > filters;
+// Returns whether the output came from the cache, content is the hash of the input if the caches took one
+bool MediaProcess::process(const FileItem & item, uint64_t & content) const
+{
+    // the caches know the input by its content
+    content = outputCache_ || pcmCache_ ? contentHash(item.input) : 0;
 
-    AVSampleFormat filterFormat;
-    if (audioCodecIn->sample_fmt == AV_SAMPLE_FMT_FLT || audioCodecIn->sample_fmt == AV_SAMPLE_FMT_FLTP
-        || audioCodecIn->sample_fmt == AV_SAMPLE_FMT_DBL || audioCodecIn->sample_fmt == AV_SAMPLE_FMT_DBLP)
+    std::filesystem::path cached;
+    if (outputCache_)
     {
-        filters = filterFab_.create<float, double>();
-        filterFormat = AV_SAMPLE_FMT_FLTP;
+        cached = outputCache_->entry(content, item.output, item.normalize);
+        if (outputCache_->fetch(cached, item.output))
+        {
+            return true;
+        }
     }
-    else
+
+    // normalizing runs again under the same admission
+    std::optional<MemoryBudget::Admission> admission;
+    if (memoryBudget_)
     {
-        filters = filterFab_.create<std::variant_alternative_t<0, decltype(filters)>::value_type::element_type::sample_t,
-                                    std::variant_alternative_t<0, decltype(filters)>::value_type::element_type::samplew_t>();
-        //filterFormat = AV_SAMPLE_FMT_S16P;
-        filterFormat = AV_SAMPLE_FMT_S32P;
+        admission.emplace(memoryBudget_->admit(footprint(item)));
     }
 
+    std::vector<float> normalizers;
+    bool ripped = false;
+    bool encoded = false;
+    do {
+        encoded = do_process(item, content, normalizers, ripped);
+        if (!encoded)
+            break;
+    } while (ripped);
 
-    int filterSampleRate = audioCodecIn->sample_rate;
+    // only an output this run moved into place, whatever was there before is not of these filters
+    if (outputCache_ && encoded && !ripped)
+    {
+        outputCache_->store(cached, item.output);
+    }
+    return false;
+}
 
-    std::visit([&filterSampleRate] (auto && filters)
-               {
-                   for (auto & filter : filters)
-                   {
-                       filterSampleRate = filter->agreeSamplerate(filterSampleRate);
-                   }
-               }, filters);
-    std::visit([&filterSampleRate] (auto && filters)
-               {
-                   for (auto & filter : filters)
-                   {
-                       filter->setSamplerate(filterSampleRate);
-                   }
-               }, filters);
 
-    std::visit([&normalizers] (auto && filters)
-               {
-                   for (size_t i = 0; i < normalizers.size(); i++)
-                       filters[i]->setNormFactor(normalizers[i]);
-               }, filters);
+bool MediaProcess::do_process(const FileItem & item, uint64_t content, std::vector<float> & normalizers, bool & ripped) const
+{
+    //#if defined(_DEBUG)
+    //    msg() << item.output.string();
+    //#endif // defined(_DEBUG)
+    bool normalize = item.normalize;
 
+    std::filesystem::create_directories(item.output.parent_path());
 
-    // SwrContext contains the audio file's sound quality parameters, such as the audio channel left/right flags (mono/stereo), 
-    //  sampling format (e.g., 16 bits), and sampling rate (e.g., 44kHz)
-    scoped_ptr<SwrContext> swr_in(nullptr, [] (SwrContext * d) { swr_free(&d); });
-    {
+    std::filesystem::path tempOut(item.output);
+    tempOut += ".tmp";
 
-        /* Force the input audio channel to have front left & right */
-        /* Force the sampling format to be signed-X-bit-planar */
-        /* Force the sampling rate to be agreed sample rate */
+    int r;
 
-        if (audioCodecIn->ch_layout.nb_channels != 2
-            || audioCodecIn->sample_fmt != filterFormat
-            || (audioCodecIn->sample_rate != filterSampleRate))
-        {
-            swr_in.reset(swr_alloc());
-            if (!swr_in) throw MPError("swr_alloc failed");
+    // *** Set up the input format ctx ***
 
-            AVChannelLayout stereoLayout = AV_CHANNEL_LAYOUT_STEREO;
-            auto swr_in_ = swr_in.get();
-            // Arguments: (swr_ctx, out, out, out, in, in, in, log_offset, log_ctx)
-            r = swr_alloc_set_opts2(&swr_in_,
-                                    &stereoLayout, filterFormat, filterSampleRate,
-                                    &audioCodecIn->ch_layout, audioCodecIn->sample_fmt, audioCodecIn->sample_rate,
-                                    0, NULL);
-            if (r != 0) throw MPError("swr_alloc_set_opts2 (in) failed", r);
+    // The encoder the output container takes, the filter layout is matched to it
+    const AVOutputFormat * outputFormat = av_guess_format(NULL, item.output.string().c_str(), NULL);
+    const AVCodecID outputCodec = outputFormat ? outputFormat->audio_codec : AV_CODEC_ID_NONE;
 
-            if ((r = swr_init(swr_in)) != 0) throw MPError("input converter init failed", r);
-        }
+    MediaInput input(item.input, filterFab_, normalizers, true, outputCodec);
+    input.setTileSamples(options_.tileSamples);
+    input.setDenormals(options_.denormals);
+    if (pcmCache_ && content != 0)
+    {
+        input.usePcmCache(*pcmCache_, content);
     }
 
+    auto avfmt_in = input.format();
+    auto audioCodecIn = input.codec();
+    auto imageStream = input.imageStream();
+    const AVSampleFormat filterFormat = input.filterFormat();
+    const int filterSampleRate = input.filterSampleRate();
+
     // *** output format ctx **
 
     scoped_ptr<AVFormatContext> avfmt_out([&item, &tempOut] ()
@@ -510,14 +1708,17 @@ bool MediaProcess::do_process(const FileItem & item, std::vector<float> & normal
 
     if (params.codec_id == AV_CODEC_ID_FIRST_AUDIO) // that is pcm
     {
-        if (filterFormat == AV_SAMPLE_FMT_FLTP)
+        if (av_get_packed_sample_fmt(filterFormat) == AV_SAMPLE_FMT_FLT)
         {
             params.codec_id = AV_CODEC_ID_PCM_F32LE;
         }
+        else if (av_get_packed_sample_fmt(filterFormat) == AV_SAMPLE_FMT_S16)
+        {
+            params.codec_id = AV_CODEC_ID_PCM_S16LE;
+        }
         else
         {
             params.codec_id = AV_CODEC_ID_PCM_S32LE;
-            //params.codec_id = AV_CODEC_ID_PCM_S16LE;
         }
     }
 
@@ -544,7 +1745,7 @@ bool MediaProcess::do_process(const FileItem & item, std::vector<float> & normal
 
     // when multiple streams are here, packet stream index should be set correspondingly
     int audioStreamOutIndex;
-    int imageStreamOutIndex;
+    int imageStreamOutIndex = -1;
 
     {
         AVStream * stream_out = 0;
@@ -566,7 +1767,7 @@ bool MediaProcess::do_process(const FileItem & item, std::vector<float> & normal
         if (!(stream_out = avformat_new_stream(avfmt_out, nullptr/*imageCodecOut->codec*/)))
             throw MPError("failed to create output stream (image)");
 
-        if ((r = avcodec_parameters_from_context(stream_out->codecpar, imageCodecIn /*imageCodecOut*/)) < 0)
+        if ((r = avcodec_parameters_from_context(stream_out->codecpar, input.imageCodec() /*imageCodecOut*/)) < 0)
             throw MPError("failed to initialize output stream parameters", r);
 
         stream_out->disposition = AV_DISPOSITION_ATTACHED_PIC;
@@ -576,12 +1777,14 @@ bool MediaProcess::do_process(const FileItem & item, std::vector<float> & normal
     // *** output converter ***
 
     // overall:
-    // in -> S16P/2/FilterSR -> filter -> out/2/OutSR -> fifo -> out
+    // in -> S16P/2/FilterSR -> filter -> out/2/OutSR -> frame_out -> out
 
     scoped_ptr<SwrContext> swr_out(nullptr, [] (SwrContext * d) { swr_free(&d); });
+    // Only the sample format may differ here, which the in-house kernels cover for the usual formats
+    ConvertKernel convertOut = findConvertKernel(filterFormat, audioCodecOut->sample_fmt);
 
     // If the output codec parameter is not what we want, then create awr_out as a format converter
-    if (audioCodecOut->sample_fmt != filterFormat)
+    if (audioCodecOut->sample_fmt != filterFormat && !convertOut)
     {
         swr_out.reset(swr_alloc());
         if (!swr_out) throw MPError("swr_alloc failed");
@@ -615,16 +1818,8 @@ bool MediaProcess::do_process(const FileItem & item, std::vector<float> & normal
 
     // *** process ***
 
-    scoped_ptr<AVFrame> frame_in(av_frame_alloc(), [] (auto * d) { av_frame_free(&d); });
-    if (!frame_in) throw MPError("failed to allocate frame");
-
-    scoped_ptr<AVAudioFifo> fifo(av_audio_fifo_alloc(audioCodecOut->sample_fmt, audioCodecOut->ch_layout.nb_channels, std::max(audioCodecOut->frame_size, 1)),
-                                 [] (auto * d) { av_audio_fifo_free(d); });
-    if (!fifo) throw MPError("failed to allocate fifo");
-
-
-    FType0<std::variant_alternative_t<0, decltype(filters)>::value_type::element_type::sample_t> ftype0;
-    FType0<std::variant_alternative_t<1, decltype(filters)>::value_type::element_type::sample_t> ftype1;
+    const int filterSampleBytes = av_get_bytes_per_sample(filterFormat);
+    const int outSampleBytes = av_get_bytes_per_sample(audioCodecOut->sample_fmt);
 
     int pts = 0;
     auto Pts = [&pts] (int samples)
@@ -634,248 +1829,337 @@ bool MediaProcess::do_process(const FileItem & item, std::vector<float> & normal
         return r;
     };
 
-    // Read one audio frame from the input file into a temporary packet.
-    bool input_eof = false;
-    int silence = filterFab_.getSilence();
-    bool is_silence_handled = (silence == 0);
-    int silence_samples = silence * filterSampleRate;
-    while (!input_eof)
+    // <TIP: Get a cover image frame from an input music file and write it to the ouptut music file>
+    // The cover goes out before any audio and before the stage threads start: a source read from the PCM cache
+    //  or from the middle is not demuxed up to its picture, and the decode stage must not write to avfmt_out
+    if (imageStream && imageStream->attached_pic.size > 0)
+    {
+        scoped_ptr<AVPacket> cover(av_packet_clone(&imageStream->attached_pic), [] (auto * d) { av_packet_free(&d); });
+        if (!cover) throw MPError("failed to copy the image frame");
+        cover->stream_index = imageStreamOutIndex;
+        r = av_write_frame(avfmt_out, cover);
+        if (r != 0) throw MPError("failed to write image frame", r);
+    }
+
+    // The encoder frame being filled is the output FIFO: the filtered samples are converted or copied straight into it
+    // and it is sent as soon as it holds frame_size samples. The frame and packet live for the whole file
+    scoped_ptr<AVFrame> frame_out(av_frame_alloc(), [] (auto * d) { av_frame_free(&d); });
+    if (!frame_out) throw MPError("failed to allocate an output frame");
+    scoped_ptr<AVPacket> packet_out(av_packet_alloc(), [] (auto * d) { av_packet_free(&d); });
+    if (!packet_out) throw MPError("failed to allocate an output packet");
+    int frameOutCapacity = 0;
+    int frameOutFill = 0;
+
+    // Get an empty frame for up to nbSamples, the buffer is reused unless the encoder still holds it or it is too small
+    auto startFrame = [&] (int nbSamples)
     {
+        if (nbSamples > frameOutCapacity || !av_frame_is_writable(frame_out))
         {
-            scoped_ptr<AVPacket> packet(av_packet_alloc(), [] (auto * d) { av_packet_free(&d); });
+            frameOutCapacity = std::max(frameOutCapacity, nbSamples);
 
-        readFrame:
-            // Read an encoded frame from the input music file
-            r = av_read_frame(avfmt_in, packet);
-            if (r == 0)
-            {   // If this frame is a cover image frame, 
-                //  write it directly to the output music file (AVFormatCtx ctx) without decoding/encoding
-                if (imageStream && (imageStream->index == packet->stream_index))
-                {
-                    // <TIP: Get a cover image frame from an input music file and write it to the ouptut music file>
-                    // <FLOW: AVFormatContext (avfmt_in) -> AVPacket (packet) -> AVFormatContext (avfmt_out) > 
-                    // Write the image stream and continue to read the next frame from the input music file
-                    packet->stream_index = imageStreamOutIndex;
-                    r = av_write_frame(avfmt_out, packet);
-                    av_packet_unref(packet);
-                    if (r != 0) throw MPError("failed to write image frame", r);
-
-                    goto readFrame;
-                }
-                // If this frame is an audio frame, send it to the input audioc codec (audioCodecIn) to decode it 
-                else if (audioStream->index == packet->stream_index)
+            av_frame_unref(frame_out);
+            frame_out->format = audioCodecOut->sample_fmt;
+            av_channel_layout_copy(&frame_out->ch_layout, &audioCodecOut->ch_layout);
+            frame_out->sample_rate = audioCodecOut->sample_rate;
+            frame_out->nb_samples = frameOutCapacity;
+            if (av_frame_get_buffer(frame_out, 0) < 0)
+                throw MPError("av_frame_get_buffer");
+        }
+        frameOutFill = 0;
+    };
+
+    // Write the filled part of the frame to the output music file, returns false if the encoder is done
+    auto sendFrame = [&] () -> bool
+    {
+        frame_out->nb_samples = frameOutFill;
+        // Set a timestamp (i.e., the total elapsed time) based on the sample rate of the container.
+        frame_out->pts = Pts(frameOutFill);
+        frameOutFill = 0;
+        return encodeFrame(frame_out, packet_out, avfmt_out, audioCodecOut, audioStreamOutIndex) == 0;
+    };
+
+    // Encode stage: move the filtered block into encoder frames and write out every complete one.
+    // A null block marks the end of the stream and sends the last short frame. Returns false if the encoder is done
+    auto encode = [&] (const SampleBlock * block) -> bool
+    {
+        if (!block)
+        {
+            return frameOutFill == 0 || sendFrame();
+        }
+
+        // Codecs without a fixed frame size get every block as a frame of its own
+        const int frameSize = audioCodecOut->frame_size > 0 ? audioCodecOut->frame_size : block->nbSamples;
+        for (int done = 0; done < block->nbSamples; )
+        {
+            if (frameOutFill == 0)
+            {
+                startFrame(frameSize);
+            }
+            const int n = std::min(frameSize - frameOutFill, block->nbSamples - done);
+
+            // An extra processing to make the output frame to be our desired 
+            //  channel layout, sampling rate, sample format (44kHz/48kHz/32kHz stereo s16p)
+            if (swr_out || convertOut)
+            {
+                // only the sample format differs, so swr gives out exactly as many samples as it takes
+                const uint8_t * in[2] = { block->data[0] + done * filterSampleBytes * block->step,
+                                          block->data[1] + done * filterSampleBytes * block->step };
+                uint8_t * out[2];
+                if (av_sample_fmt_is_planar(audioCodecOut->sample_fmt))
                 {
-                    r = avcodec_send_packet(audioCodecIn, packet);
-                    if (r == 0)
-                    {   // <TIP: get a raw frame from the input music file with a proper codec-decoding>
-                        // <FLOW: AVFormatContext (avfmt_in) -> AVPacket (packet) -> AVCodexContext (audioCodecIn) 
-                        //   -> AVFrame (frame_in) >
-                        r = avcodec_receive_frame(audioCodecIn, frame_in);
-                        if (r == 0 || r == AVERROR_EOF)
-                        {
-                            // return r;
-                        }
-                        else if (r == AVERROR(EAGAIN))
-                        {
-                            goto readFrame;
-                        }
-                        else
-                        {
-                            throw MPError("failed to receive frame", r);
-                        }
-                    }
-                    else if (r == AVERROR_INVALIDDATA
-                             && (audioCodecIn->codec_id == AV_CODEC_ID_MP3
-                                 || audioCodecIn->codec_id == AV_CODEC_ID_WMAV1 || audioCodecIn->codec_id == AV_CODEC_ID_WMAV2))
-                    {
-                        // MP3 https://trac.ffmpeg.org/ticket/7879
-                        goto readFrame;
-                    }
-                    else if (r == AVERROR(EPERM)
-                             && (audioCodecIn->codec_id == AV_CODEC_ID_WMAV1 || audioCodecIn->codec_id == AV_CODEC_ID_WMAV2))
-                    {
-                        // WMA https://trac.ffmpeg.org/ticket/9358
-                        goto readFrame;
-                    }
-                    else
-                    {
-                        throw MPError("failed to send packet (input)", r);
-                    }
+                    out[0] = frame_out->data[0] + frameOutFill * outSampleBytes;
+                    out[1] = frame_out->data[1] + frameOutFill * outSampleBytes;
                 }
                 else
                 {
-                    // unknown stream index
-                    continue;
+                    out[0] = frame_out->data[0] + frameOutFill * outSampleBytes * 2;
+                    out[1] = nullptr;
                 }
-            }
-        }
-        // If some non-zero sample size of the input frame is successfully decoded 
-        if (r != AVERROR_EOF && frame_in->nb_samples > 0 || !is_silence_handled)
-        {  int nb_samples;
-           if (r != AVERROR_EOF && frame_in->nb_samples > 0) 
-           {    // If the current channel's layout id is different than the one specified in the input codec
-					if (frame_in->ch_layout.nb_channels != srcChannels)
-					{
-						 // Oh, the channel layout can dynamically change in the middle lol
-						 throw MPError("channel layout had changed in the middle");
-					}
-
-					// This is the input music file's decoded raw frame
-					nb_samples = frame_in->nb_samples;
-
-					// If the input music file is NOT in the format we want (44kHz stereo, signe 16 bits, planar)
-					if (swr_in)
-					{
-						 // frame -> l/rb
-
-						 // An upper bound on the number of samples that the next swr_convert will output
-						 auto swrOutSamples = swr_get_out_samples(swr_in, nb_samples);
-
-						 // Dynamically increase the lb, rb vector size to be the maximum number of samples 
-						 //  across all decoded raw frames of the input music file
-						 filters.index() ? ftype1.resizeIn(swrOutSamples) : ftype0.resizeIn(swrOutSamples);
-
-						 auto buffers = (filters.index() ? ftype1.buffersIn() : ftype0.buffersIn());
-
-						 // Convert the input music file's decoded raw frame to be our desired format (signed 16-bits, planar, 44100 fps)
-						 nb_samples = swr_convert(swr_in, buffers.data(), swrOutSamples, (const uint8_t **)frame_in->data, nb_samples);
-						 // cannot // assert(nb_samples == cwrOutSamples);
-
-						 // 128 bytes gap of Q2 ClaStr filter output to CH
-						 //if (isFirstChunk)
-						 //{
-						 //    nb_samples += 128;
-						 //    lb.insert(lb.begin(), 128, 0);
-						 //    rb.insert(rb.begin(), 128, 0);
-						 //    isFirstChunk = false;
-						 //}
-					}
-					// If the input music file is in the format we want
-					else
-					{
-						 filters.index() ? ftype1.buffersExt(frame_in->data[0], frame_in->data[1], nb_samples) : ftype0.buffersExt(frame_in->data[0], frame_in->data[1], nb_samples);
-					}
-           }
-           else
-           {     nb_samples = silence_samples; 
-                 filters.index() ? ftype1.resizeIn(nb_samples) : ftype0.resizeIn(nb_samples);
-                 auto in_planes_vec = (filters.index() ? ftype1.buffersIn() : ftype0.buffersIn());
-                 uint8_t **in_planes = in_planes_vec.data(); 
-                 const int n_channels = 2; // you force stereo 
-                 audioCodecOut->sample_fmt; 
-                 av_samples_set_silence(in_planes, /*offset=*/0, nb_samples, n_channels, filterFormat); 
-                 filters.index() ? ftype1.resizeOut(nb_samples) : ftype0.resizeOut(nb_samples);
-                 is_silence_handled = true;
-           }
-
-            // Filter-processing
-
-            // convert can produce no samples ... if the input is like 1 sample ... uhhh 
-            if (nb_samples > 0)
-            {
-                // These are for output data (after filter-processing)
-                (filters.index() ? ftype1.resizeOut(nb_samples) : ftype0.resizeOut(nb_samples));
-
-                std::visit([&ftype0, &ftype1, &filters, nb_samples] (auto && fs)
-                           {
-                                for (auto filter = fs.begin(); filter != fs.end(); ++filter)
-                                {
-                                    filters.index() ? ftype1.run(**filter, nb_samples) : ftype0.run(**filter, nb_samples);
-
-                                    // Reuse the same lb, rb, lbOut, rbOut buffers when processing through multiple filters
-                                    if (filter + 1 != fs.end())
-                                    {
-                                        filters.index() ? ftype1.swap() : ftype0.swap();
-                                    }
-                                }
-                           }, filters);
-
-                // An extra processing to make the output frame to be our desired 
-                //  channel layout, sampling rate, sample format (44kHz/48kHz/32kHz stereo s16p)
-                if (swr_out)
-                {
-                    // l/rbOut -> fifo buffers
 
-                    auto swrOutSamples = swr_get_out_samples(swr_out, nb_samples);
-                    auto channels = audioCodecOut->ch_layout.nb_channels;
-                    auto bs = av_samples_get_buffer_size(0, channels, swrOutSamples, audioCodecOut->sample_fmt, 0);
-
-                    // Resize to required size but send both buffers even for interleaved
-                    filters.index() ? ftype1.resizeIn(bs) : ftype0.resizeIn(bs);
-
-                    auto toConvert = (filters.index() ? ftype1.buffersOut() : ftype0.buffersOut());
-                    auto fromConvert = (filters.index() ? ftype1.buffersIn() : ftype0.buffersIn());
-
-                    nb_samples = swr_convert(swr_out, fromConvert.data(), bs, (const uint8_t **)toConvert.data(), nb_samples);
-                    writeToFifo(fifo, (void **)fromConvert.data(), nb_samples);
+                if (convertOut)
+                {
+                    convertOut(in, out, n);
                 }
-                // If the output is already of suitable format
                 else
                 {
-                    auto buffers = (filters.index() ? ftype1.buffersOut() : ftype0.buffersOut());
-                    writeToFifo(fifo, (void **)buffers.data(), nb_samples);
+                    int r = swr_convert(swr_out, out, n, in, n);
+                    if (r != n) throw MPError("failed to convert output samples", r);
                 }
             }
-        }
-        else
-        {
-            input_eof = true;
-            r = 0;
-        }
+            // If the output is already of suitable format
+            else
+            {
+                av_samples_copy(frame_out->data, (uint8_t * const *)block->data.data(), frameOutFill, done, n, 2, filterFormat);
+            }
 
-    fflushFifo:
+            frameOutFill += n;
+            done += n;
+            if (frameOutFill == frameSize && !sendFrame())
+            {
+                return false;
+            }
+        }
+        return true;
+    };
 
-        const int samplesAvail = av_audio_fifo_size(fifo);
-        // The frameSize is max chunk we can send to the output codec and this can be less than the filtered available frame data
-        const int frameSize = audioCodecOut->frame_size > 0 ? audioCodecOut->frame_size : samplesAvail;
+    // Split long inputs into time segments filtered in parallel, the encoder splices them in order
+    int segments = options_.segments;
+    const int64_t warmup = int64_t(options_.warmup) * filterSampleRate;
+    const int64_t duration = input.duration();
+    if (segments > 1)
+    {
+        // a segment shorter than a few warm-ups would mostly be warm-up
+        segments = int(std::min<int64_t>(segments, duration / std::max<int64_t>(3 * warmup, filterSampleRate)));
+    }
 
-        // If no frame has been written and there is no available output frame, then this is an empty file, so finish
-        if (frameSize == 0 || samplesAvail == 0)
+    bool encoded = true;
+    if (segments > 1)
+    {
+        std::vector<std::filesystem::path> raws;
+        // the segments are tasks of the pool running the files, this worker runs them too while it waits
+        std::vector<FilterChain> chains(segments);
+        std::deque<TaskGroup> rendered;
+        for (int i = 0; i < segments; i++)
         {
-            break;
+            auto raw = tempOut;
+            raw += ".seg" + std::to_string(i);
+            raws.push_back(raw);
+
+            int64_t start = duration * i / segments;
+            // the last one runs to the real end of the input and gets the silence
+            int64_t end = i + 1 == segments ? std::numeric_limits<int64_t>::max() : duration * (i + 1) / segments;
+            rendered.emplace_back().run([this, &item, &normalizers, &chain = chains[i], outputCodec, content, start, end, warmup, raw] ()
+                                        {
+                                            MediaInput segmentInput(item.input, filterFab_, normalizers, false, outputCodec);
+                                            segmentInput.setTileSamples(options_.tileSamples);
+                                            segmentInput.setDenormals(options_.denormals);
+                                            if (pcmCache_ && content != 0)
+                                            {
+                                                segmentInput.usePcmCache(*pcmCache_, content);
+                                            }
+                                            renderSegment(segmentInput, start, end, warmup, raw);
+                                            chain = std::move(segmentInput.filters());
+                                        });
         }
 
-        // When the frame is the last one, the available size is equal to or less than the frame size
-        // When the frame is not the last one, the available size is more than the frame size
-        if (samplesAvail >= frameSize || input_eof)
+        try
         {
-            scoped_ptr<AVFrame> frame_out(av_frame_alloc(),
-                                          [] (auto * d) { av_frame_free(&d); });
-            if (!frame_out) throw MPError("failed to allocate an output frame");
-
-            frame_out->format = audioCodecOut->sample_fmt;
-            av_channel_layout_copy(&frame_out->ch_layout, &audioCodecOut->ch_layout);
-            frame_out->sample_rate = audioCodecOut->sample_rate;
+            for (int i = 0; i < segments && encoded; i++)
+            {
+                rendered[i].wait();
+                auto & filters = chains[i];
 
-            do
-            {   // This is correct number of maximum samples to read for both the last and non-last frames
-                frame_out->nb_samples = std::min(samplesAvail, frameSize);
-                // Set a timestamp (i.e., the total elapsed time) based on the sample rate of the container.
-                frame_out->pts = Pts(frame_out->nb_samples);
+                // keep the peaks of every segment for the normalization
+                std::visit([&filters] (auto && mainFilters)
+                           {
+                               auto & segmentFilters = std::get<std::decay_t<decltype(mainFilters)>>(filters);
+                               for (size_t f = 0; f < mainFilters.size(); f++)
+                               {
+                                   mainFilters[f]->mergePeaks(*segmentFilters[f]);
+                               }
+                           }, input.filters());
 
-                if (!av_frame_is_writable(frame_out))
+                std::ifstream is(raws[i], std::ios::binary);
+                SampleBlock block;
+                while (encoded && readBlock(is, block, filterSampleBytes, input.interleaved()))
+                {
+                    encoded = encode(&block);
+                }
+                if (!options_.verifySegments)
                 {
-                    // We're in a while loop, so reuse the buffer we have in frame_out
-                    if ((r = av_frame_get_buffer(frame_out, 0)) < 0)
-                        throw MPError("av_frame_get_buffer");
+                    is.close();
+                    std::filesystem::remove(raws[i]);
                 }
-                // Read the filtered frame of the exact size we expect
-                if (av_audio_fifo_read(fifo, (void **)frame_out->data, frame_out->nb_samples) < frame_out->nb_samples)
-                    throw MPError("failed to read from fifo");
+            }
+            if (encoded)
+            {
+                encoded = encode(nullptr);
+            }
 
-                // Write the frame to the output music file
-                if ((r = encodeFrame(frame_out, avfmt_out, audioCodecOut, audioStreamOutIndex)) != 0)
+            if (options_.verifySegments)
+            {
+                MediaInput sequential(item.input, filterFab_, normalizers, false, outputCodec);
+                sequential.setTileSamples(options_.tileSamples);
+                sequential.setDenormals(options_.denormals);
+                if (pcmCache_ && content != 0)
                 {
-                    break;
+                    sequential.usePcmCache(*pcmCache_, content);
                 }
-            } while (av_audio_fifo_size(fifo) >= frameSize);
+                verifySegments(sequential, raws, item.input.filename().string());
+            }
+        }
+        catch (...)
+        {
+            // the segments still running finish before their files go
+            rendered.clear();
+            for (auto & raw : raws)
+            {
+                std::error_code ec;
+                std::filesystem::remove(raw, ec);
+            }
+            throw;
+        }
+        for (auto & raw : raws)
+        {
+            std::error_code ec;
+            std::filesystem::remove(raw, ec);
+        }
+    }
+    else if (!options_.pipeline)
+    {
+        // in lockstep with the other files of the same chain type
+        std::optional<LaneScheduler::Ticket> lane;
+        if (laneScheduler_)
+        {
+            lane.emplace(*laneScheduler_, input.filters(), input.tileSamples());
         }
+
+        SampleBlock block;
+        while (encoded && input.decode(block, !lane))
+        {
+            if (lane)
+                lane->dsp(block);
+            else
+                input.dsp(block);
+            encoded = encode(&block);
+        }
+        lane.reset();
+        if (encoded)
+        {
+            encoded = encode(nullptr);
+        }
+    }
+    else
+    {
+        // decode -> dsp stage(s) -> encode, each a task on the pool; blocks travel back to the decoder through the free queue.
+        // Every filter still sees its samples in order, so splitting the chain does not change the output.
+        // A null block is the end of the stream. The queues hold all the blocks, so a push never fails and no
+        // stage waits: it takes the blocks that are there and schedules the next stage for each one it passes on
+        std::vector<size_t> bounds { 0, input.filterCount() };
+        if (options_.filterStages > 1 && input.filterCount() > 1)
+        {
+            bounds = balanceStages(input.filterCosts(), options_.filterStages);
+        }
+        const size_t dspStages = bounds.size() - 1;
+
+        const size_t poolSize = 8 + 2 * dspStages;
+        std::vector<SampleBlock> pool(poolSize);
+        SpscQueue<SampleBlock *> freeBlocks(poolSize);
+        // queues[i] feeds dsp stage i, the last one feeds the encoder
+        std::vector<std::unique_ptr<SpscQueue<SampleBlock *>>> queues;
+        for (size_t i = 0; i <= dspStages; i++)
+        {
+            queues.push_back(std::make_unique<SpscQueue<SampleBlock *>>(poolSize));
+        }
+        auto & decoded = *queues.front();
+        auto & filtered = *queues.back();
+        for (auto & block : pool)
+        {
+            freeBlocks.push(&block);
+        }
+
+        // stage 0 decodes, 1 to dspStages filter, the last one encodes
+        StageTasks stages;
+        bool decodedAll = false;
+        stages.add([&] ()
+                   {
+                       SampleBlock * block;
+                       while (!decodedAll && !stages.abort && freeBlocks.pop(block))
+                       {
+                           if (!input.decode(*block, false))
+                           {
+                               decodedAll = true;
+                               block = nullptr;
+                           }
+                           decoded.push(block);
+                           stages.schedule(1);
+                       }
+                   });
+        for (size_t stage = 0; stage < dspStages; stage++)
+        {
+            stages.add([&, stage] ()
+                       {
+                           auto & in = *queues[stage];
+                           auto & out = *queues[stage + 1];
+                           SampleBlock * block;
+                           while (!stages.abort && in.pop(block))
+                           {
+                               if (block)
+                               {
+                                   input.dsp(*block, bounds[stage], bounds[stage + 1]);
+                               }
+                               out.push(block);
+                               stages.schedule(stage + 2);
+                           }
+                       });
+        }
+        stages.add([&] ()
+                   {
+                       SampleBlock * block;
+                       while (!stages.abort && filtered.pop(block))
+                       {
+                           encoded = encode(block);
+                           if (!encoded)
+                           {
+                               // the encoder is closed, the others stop
+                               stages.abort = true;
+                           }
+                           if (!block || !encoded)
+                           {
+                               break;
+                           }
+                           freeBlocks.push(block);
+                           stages.schedule(0);
+                       }
+                   });
+        stages.schedule(0);
+        stages.join();
     }
 
-    if (r == 0)
+    if (encoded)
     {
         // Encode all unencoded remaining data and flush them to the output music file
-        do {} while (encodeFrame(NULL, avfmt_out, audioCodecOut, audioStreamOutIndex) == 0);
+        do {} while (encodeFrame(NULL, packet_out, avfmt_out, audioCodecOut, audioStreamOutIndex) == 0);
 
         // Flush all encoded remaining data to the output music file
         if ((r = av_write_trailer(avfmt_out)) < 0)
@@ -914,12 +2198,12 @@ bool MediaProcess::do_process(const FileItem & item, std::vector<float> & normal
                                }
                                i++;
                            }
-                       }, filters);
+                       }, input.filters());
         }
         // save the music file only if there is no ripping sound
         if (!ripped)
             std::filesystem::rename(tempOut, item.output);
     }
-    return r == 0;
+    return encoded;
 }
 
@@ -4,9 +4,12 @@
 #include <vector>
 #include <filesystem>
 #include <functional>
+#include <mutex>
+#include <map>
 
 #include "filter.h"
 #include "FilterFabric.hpp"
+#include "denormals.h"
 
 
 struct FileItem
@@ -14,17 +17,77 @@ struct FileItem
     std::filesystem::path input;
     std::filesystem::path output;
     bool normalize;
+    // the sample rate and the frame size of the audio by its header, 0 when it was not read (see probeMedia)
+    int sampleRate = 0;
+    int frameSize = 0;
 };
 
+// What the container header of an input tells without reading its streams, 0 for what it does not
+struct MediaProbe
+{
+    // seconds of audio
+    double seconds = 0;
+    int sampleRate = 0;
+    // samples in a frame of the audio codec
+    int frameSize = 0;
+};
+
+MediaProbe probeMedia(const std::filesystem::path & input);
+
+
+struct ProcessOptions
+{
+    // decode, filter and encode each file in parallel, as tasks on the pool connected by queues
+    bool pipeline = false;
+    // split the filter chain of a pipelined file into up to this many stages run in parallel
+    int filterStages = 1;
+    // stereo samples each filter runs on before the tile moves to the next filter, 0 picks it from the L1 cache size
+    int tileSamples = 0;
+    // filter this many files of the same chain in lockstep, one per SIMD lane of the filters' lane kernels, 0 or 1 is off
+    int lanes = 0;
+    // how the float filter chains keep out of subnormal numbers
+    DenormalMode denormals = DenormalMode::Flush;
+
+    // filter long files as this many time segments in parallel, 0 or 1 is off
+    int segments = 0;
+    // seconds each segment starts early so that the filter states converge before the splice
+    int warmup = 10;
+    // measure the spliced output against the sequential one
+    bool verifySegments = false;
+
+    // start a file only while the memory estimated for the files in work fits into this many bytes, 0 is no limit
+    size_t maxMemory = 0;
+
+    // take the outputs rendered before from this content-addressed store and keep the new ones in it up to
+    //  cacheBytes, empty is off
+    std::filesystem::path cache;
+    size_t cacheBytes = 0;
+    // keep the decoded inputs in this directory up to pcmCacheBytes and decode from there, empty is off
+    std::filesystem::path pcmCache;
+    size_t pcmCacheBytes = 0;
+
+    // told of every file as it ends, whether its output was written and the content hash of its input if the
+    //  caches took one (0 otherwise)
+    std::function<void(const FileItem &, bool, uint64_t)> finished;
+};
+
+
+// Everything that makes the output of the filter chains under the options, FilterFabric::description with the
+// float modes of the options; the same description gives the same output
+std::wstring chainDescription(const FilterFabric & fab, const ProcessOptions & options);
+
+
+class LaneScheduler;
+class MemoryBudget;
+class OutputCache;
+class PcmCache;
 
 class MediaProcess
 {
     MediaProcess(const MediaProcess &) = delete;
     MediaProcess operator=(const MediaProcess &) = delete;
 public:
-    MediaProcess(const FilterFabric & fab)
-        : filterFab_(fab)
-    {}
+    MediaProcess(const FilterFabric & fab, const ProcessOptions & options = {});
 
     #if defined(_WIN32)
     std::wstring
@@ -33,9 +96,23 @@ public:
     #endif
         operator()(const FileItem & item) const;
 
+    // The bytes a file is estimated to take while it is processed under the options, --max-memory admits by it
+    size_t footprint(const FileItem & item) const;
+
 private:
-    void process(const FileItem & item) const;
-    bool do_process(const FileItem & item, std::vector<float> & normalizers, bool & ripped) const;
+    bool process(const FileItem & item, uint64_t & content) const;
+    bool do_process(const FileItem & item, uint64_t content, std::vector<float> & normalizers, bool & ripped) const;
+    size_t chainStateBytes(int sampleRate) const;
+    void finished(const FileItem & item, bool written, uint64_t content = 0) const;
 
     FilterFabric filterFab_;
+    ProcessOptions options_;
+    std::shared_ptr<LaneScheduler> laneScheduler_;
+    std::shared_ptr<MemoryBudget> memoryBudget_;
+    std::shared_ptr<OutputCache> outputCache_;
+    std::shared_ptr<PcmCache> pcmCache_;
+
+    // the bytes of the filter states by the input sample rate
+    mutable std::mutex stateBytesMtx_;
+    mutable std::map<int, size_t> stateBytes_;
 };
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <random>
+#include <cctype>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include <filesystem>
+#include <system_error>
+
+#include "contentHash.h"
+
+
+// Rendered files by what makes them: the content of the input, the filter chain and the output format. Every run
+// and the web server pointing at the same directory share it, so a song rendered once is only linked the next time,
+// whatever it is called and wherever it lies. Files go in and out as hard links when the store and the outputs
+// are on one file system and as copies otherwise, always under a temporary name first, so that concurrent runs
+// never see half a file. The least recently used files go when the store outgrows its size
+class OutputCache
+{
+    OutputCache(const OutputCache &) = delete;
+    OutputCache operator=(const OutputCache &) = delete;
+public:
+    // chain is the description of the filters, see chainDescription
+    OutputCache(const std::filesystem::path & dir, const std::wstring & chain, uintmax_t maxBytes)
+        : dir_(dir)
+        , chain_(hashBytes(chain.data(), chain.size() * sizeof(wchar_t)))
+        , maxBytes_(maxBytes)
+    {}
+
+    // The place in the store of the output of an input with the content hash, empty if the input could not be read
+    std::filesystem::path entry(uint64_t content, const std::filesystem::path & output, bool normalize) const
+    {
+        if (content == 0)
+        {
+            return {};
+        }
+        auto format = output.extension().string();
+        for (auto & c : format)
+        {
+            c = char(std::tolower((unsigned char)c));
+        }
+        uint64_t key = hashBytes(format.data(), format.size(), chain_ ^ (normalize ? 0x6E6F726Dull : 0));
+        key = hashBytes(&content, sizeof(content), key);
+
+        char hex[17];
+        std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)key);
+        return dir_ / std::string(hex, 2) / (std::string(hex) + format);
+    }
+
+    // Puts the stored file at output, false if it is not in the store
+    bool fetch(const std::filesystem::path & entry, const std::filesystem::path & output) const
+    {
+        std::error_code ec;
+        if (entry.empty() || !std::filesystem::is_regular_file(entry, ec))
+        {
+            return false;
+        }
+        std::filesystem::create_directories(output.parent_path(), ec);
+        if (!place(entry, output))
+        {
+            return false;
+        }
+        // a file fetched is the most recently used (a linked output shares the time)
+        std::filesystem::last_write_time(entry, std::filesystem::file_time_type::clock::now(), ec);
+        return true;
+    }
+
+    // Keeps the output in the store
+    void store(const std::filesystem::path & entry, const std::filesystem::path & output) const
+    {
+        std::error_code ec;
+        if (entry.empty() || std::filesystem::is_regular_file(entry, ec))
+        {
+            return;
+        }
+        std::filesystem::create_directories(entry.parent_path(), ec);
+        if (place(output, entry))
+        {
+            trim();
+        }
+    }
+
+    // Removes the least recently used files above the size of the store
+    void trim() const
+    {
+        std::lock_guard lock(mtx_);
+        std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> files;
+        uintmax_t total = 0;
+        std::error_code ec;
+        for (std::filesystem::recursive_directory_iterator it(dir_, ec), end; !ec && it != end; it.increment(ec))
+        {
+            std::error_code fileEc;
+            // the files of other runs still being placed
+            if (it->is_regular_file(fileEc) && it->path().extension() != ".tmp")
+            {
+                total += it->file_size(fileEc);
+                files.emplace_back(it->last_write_time(fileEc), it->path());
+            }
+        }
+        std::sort(files.begin(), files.end());
+        for (auto & [time, file] : files)
+        {
+            if (total <= maxBytes_)
+            {
+                break;
+            }
+            std::error_code fileEc;
+            const auto size = std::filesystem::file_size(file, fileEc);
+            if (std::filesystem::remove(file, fileEc))
+            {
+                total -= size;
+            }
+        }
+    }
+
+private:
+    static bool place(const std::filesystem::path & from, const std::filesystem::path & to)
+    {
+        auto temp = to;
+        temp += "." + std::to_string(std::random_device()()) + ".tmp";
+        std::error_code ec;
+        std::filesystem::create_hard_link(from, temp, ec);
+        if (ec)
+        {
+            ec.clear();
+            std::filesystem::copy_file(from, temp, ec);
+        }
+        if (!ec)
+        {
+            std::filesystem::rename(temp, to, ec);
+        }
+        if (ec)
+        {
+            std::filesystem::remove(temp, ec);
+            return false;
+        }
+        return true;
+    }
+
+    const std::filesystem::path dir_;
+    const uint64_t              chain_;
+    const uintmax_t             maxBytes_;
+    mutable std::mutex          mtx_;
+};
@@ -0,0 +1,361 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <random>
+#include <memory>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+#include <system_error>
+
+#if defined(_WIN32)
+#if !defined(NOMINMAX)
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "contentHash.h"
+
+
+// A whole file mapped read-only into memory
+class MappedFile
+{
+    MappedFile(const MappedFile &) = delete;
+    MappedFile operator=(const MappedFile &) = delete;
+public:
+    explicit MappedFile(const std::filesystem::path & path)
+    {
+    #if defined(_WIN32)
+        HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            return;
+        }
+        LARGE_INTEGER size;
+        if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+        {
+            if (HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL))
+            {
+                data_ = (uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                size_ = data_ ? size_t(size.QuadPart) : 0;
+                CloseHandle(mapping);
+            }
+        }
+        CloseHandle(file);
+    #else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void * p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                data_ = (uint8_t *)p;
+                size_ = size_t(st.st_size);
+                // read front to back
+                madvise(p, size_, MADV_SEQUENTIAL);
+            }
+        }
+        ::close(fd);
+    #endif
+    }
+
+    ~MappedFile()
+    {
+        if (!data_)
+        {
+            return;
+        }
+    #if defined(_WIN32)
+        UnmapViewOfFile(data_);
+    #else
+        munmap(data_, size_);
+    #endif
+    }
+
+    const uint8_t * data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    uint8_t *   data_ = nullptr;
+    size_t      size_ = 0;
+};
+
+
+// The decoded audio of the inputs in the filter format and rate, so that rendering a file again with other filters
+// skips the demuxer, the decoder and the input converter. A file holds the stereo samples in chunks of Chunk samples,
+// the left then the right plane of each or its interleaved pairs, so that any block is read in place from the
+// mapped file. The least recently used files go when the cache outgrows its size
+class PcmCache
+{
+    PcmCache(const PcmCache &) = delete;
+    PcmCache operator=(const PcmCache &) = delete;
+public:
+    static constexpr int Chunk = 16384;
+
+    // What the samples of a file are, its first bytes
+    struct Header
+    {
+        char        magic[4] = { 'S', 'E', 'P', 'C' };
+        uint32_t    version = 1;
+        int32_t     format = 0;
+        int32_t     sampleRate = 0;
+        int32_t     sampleBytes = 0;
+        int32_t     interleaved = 0;
+        // the stereo samples and the stream position of the first one
+        int64_t     samples = 0;
+        int64_t     first = 0;
+        uint8_t     reserved[24] = {};
+
+        bool matches(const Header & other) const
+        {
+            return std::memcmp(magic, other.magic, 4) == 0 && version == other.version && format == other.format
+                && sampleRate == other.sampleRate && sampleBytes == other.sampleBytes && interleaved == other.interleaved;
+        }
+    };
+    static_assert(sizeof(Header) == 64, "the samples start on a cache line");
+
+    // A file of the cache mapped for reading
+    class Reader
+    {
+    public:
+        Reader(const std::filesystem::path & path, const Header & expected)
+            : file_(path)
+        {
+            if (file_.size() >= sizeof(Header))
+            {
+                std::memcpy(&header_, file_.data(), sizeof(Header));
+                const size_t chunks = size_t((header_.samples + Chunk - 1) / Chunk);
+                valid_ = header_.matches(expected) && header_.samples >= 0
+                    && file_.size() >= sizeof(Header) + chunks * chunkBytes();
+            }
+        }
+
+        bool valid() const { return valid_; }
+        int64_t samples() const { return header_.samples; }
+        int64_t first() const { return header_.first; }
+
+        // The left and the right samples at the index, up to the end of its chunk
+        int at(int64_t index, const uint8_t *& left, const uint8_t *& right) const
+        {
+            const uint8_t * chunk = file_.data() + sizeof(Header) + size_t(index / Chunk) * chunkBytes();
+            const int offset = int(index % Chunk);
+            const int bytes = header_.sampleBytes;
+            if (header_.interleaved)
+            {
+                left = chunk + size_t(offset) * bytes * 2;
+                right = left + bytes;
+            }
+            else
+            {
+                left = chunk + size_t(offset) * bytes;
+                right = chunk + size_t(Chunk) * bytes + size_t(offset) * bytes;
+            }
+            return int(std::min<int64_t>(Chunk - offset, header_.samples - index));
+        }
+
+    private:
+        size_t chunkBytes() const { return size_t(Chunk) * header_.sampleBytes * 2; }
+
+        MappedFile  file_;
+        Header      header_;
+        bool        valid_ = false;
+    };
+
+    // Writes a file of the cache as the samples are decoded, it is only there once finish() is called. Nothing is
+    //  written before the first samples come
+    class Writer
+    {
+        Writer(const Writer &) = delete;
+        Writer operator=(const Writer &) = delete;
+    public:
+        Writer(PcmCache & cache, const std::filesystem::path & path, const Header & header)
+            : cache_(cache)
+            , path_(path)
+            , header_(header)
+            , chunk_(size_t(Chunk) * header.sampleBytes * 2)
+        {}
+
+        ~Writer()
+        {
+            if (os_.is_open())
+            {
+                os_.close();
+                std::error_code ec;
+                std::filesystem::remove(temp_, ec);
+            }
+        }
+
+        // The next samples of the stream, position is that of the first of them
+        void append(const uint8_t * left, const uint8_t * right, int samples, int step, int64_t position)
+        {
+            if (!os_.is_open())
+            {
+                header_.first = position;
+                temp_ = path_;
+                temp_ += "." + std::to_string(std::random_device()()) + ".tmp";
+                os_.open(temp_, std::ios::binary | std::ios::trunc);
+                os_.write((const char *)&header_, sizeof(header_));
+            }
+            const int bytes = header_.sampleBytes;
+            while (samples > 0 && os_)
+            {
+                const int count = std::min(samples, Chunk - fill_);
+                if (header_.interleaved)
+                {
+                    std::memcpy(chunk_.data() + size_t(fill_) * bytes * 2, left, size_t(count) * bytes * 2);
+                }
+                else
+                {
+                    for (int i = 0; i < count; i++)
+                    {
+                        std::memcpy(chunk_.data() + size_t(fill_ + i) * bytes, left + size_t(i) * bytes * step, bytes);
+                        std::memcpy(chunk_.data() + size_t(Chunk + fill_ + i) * bytes, right + size_t(i) * bytes * step, bytes);
+                    }
+                }
+                left += size_t(count) * bytes * step;
+                right += size_t(count) * bytes * step;
+                samples -= count;
+                fill_ += count;
+                header_.samples += count;
+                if (fill_ == Chunk)
+                {
+                    os_.write((const char *)chunk_.data(), chunk_.size());
+                    fill_ = 0;
+                }
+            }
+        }
+
+        // The stream ended, the file goes into the cache
+        void finish()
+        {
+            if (!os_.is_open())
+            {
+                return;
+            }
+            if (fill_ > 0)
+            {
+                std::fill(chunk_.begin() + size_t(fill_) * header_.sampleBytes * (header_.interleaved ? 2 : 1),
+                          chunk_.begin() + size_t(Chunk) * header_.sampleBytes * (header_.interleaved ? 2 : 1), 0);
+                if (!header_.interleaved)
+                {
+                    std::fill(chunk_.begin() + size_t(Chunk + fill_) * header_.sampleBytes, chunk_.end(), 0);
+                }
+                os_.write((const char *)chunk_.data(), chunk_.size());
+                fill_ = 0;
+            }
+            os_.seekp(0);
+            os_.write((const char *)&header_, sizeof(header_));
+            os_.close();
+
+            std::error_code ec;
+            if (!os_)
+            {
+                std::filesystem::remove(temp_, ec);
+                return;
+            }
+            std::filesystem::rename(temp_, path_, ec);
+            if (ec)
+            {
+                std::filesystem::remove(temp_, ec);
+                return;
+            }
+            cache_.trim();
+        }
+
+    private:
+        PcmCache &              cache_;
+        std::filesystem::path   path_;
+        std::filesystem::path   temp_;
+        Header                  header_;
+        std::vector<uint8_t>    chunk_;
+        int                     fill_ = 0;
+        std::ofstream           os_;
+    };
+
+    PcmCache(const std::filesystem::path & dir, uintmax_t maxBytes)
+        : dir_(dir)
+        , maxBytes_(maxBytes)
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(dir_, ec);
+    }
+
+    // The file of the decoded input content in the format of the header
+    std::filesystem::path path(uint64_t content, const Header & header) const
+    {
+        uint64_t key = hashBytes(&header.format, 4 * sizeof(int32_t), content);
+        char hex[17];
+        std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)key);
+        return dir_ / (std::string(hex) + ".pcm");
+    }
+
+    // The cached file, null if it is not there. A file read is the most recently used
+    std::unique_ptr<Reader> open(const std::filesystem::path & path, const Header & header) const
+    {
+        std::error_code ec;
+        if (!std::filesystem::is_regular_file(path, ec))
+        {
+            return nullptr;
+        }
+        auto reader = std::make_unique<Reader>(path, header);
+        if (!reader->valid())
+        {
+            return nullptr;
+        }
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+        return reader;
+    }
+
+    // Removes the least recently used files above the size of the cache
+    void trim()
+    {
+        std::lock_guard lock(mtx_);
+        std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> files;
+        uintmax_t total = 0;
+        std::error_code ec;
+        for (std::filesystem::directory_iterator it(dir_, ec), end; !ec && it != end; it.increment(ec))
+        {
+            if (it->path().extension() == ".pcm")
+            {
+                std::error_code fileEc;
+                total += it->file_size(fileEc);
+                files.emplace_back(it->last_write_time(fileEc), it->path());
+            }
+        }
+        std::sort(files.begin(), files.end());
+        for (auto & [time, file] : files)
+        {
+            if (total <= maxBytes_)
+            {
+                break;
+            }
+            std::error_code fileEc;
+            const auto size = std::filesystem::file_size(file, fileEc);
+            if (std::filesystem::remove(file, fileEc))
+            {
+                total -= size;
+            }
+        }
+    }
+
+private:
+    const std::filesystem::path dir_;
+    const uintmax_t             maxBytes_;
+    std::mutex                  mtx_;
+};
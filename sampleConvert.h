@@ -0,0 +1,530 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#include "cpuFeatures.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define SAMPLE_CONVERT_SSE2
+#endif
+#if defined(SAMPLE_CONVERT_SSE2) && defined(CPU_DISPATCH)
+#define SAMPLE_CONVERT_AVX2
+#define SAMPLE_CONVERT_AVX512
+#endif
+
+
+// Stereo sample repacking between the plain formats (S16/S32/FLT, packed or planar) for the cases
+// where libswresample would only convert the format. The rounding and clipping follow swr's conversions,
+// so the output is the same as with swr
+
+enum class SampleKind { S16, S32, FLT };
+
+struct SampleLayout
+{
+    SampleKind  kind;
+    bool        planar;
+};
+
+// in/out are the plane pointers (only the first one is used for a packed layout)
+using ConvertKernel = void (*)(const uint8_t * const * in, uint8_t * const * out, int nbSamples);
+
+
+namespace sample_convert
+{
+
+template<typename Out, typename In>
+inline Out convert(In v)
+{
+    if constexpr (std::is_same_v<In, Out>)
+    {
+        return v;
+    }
+    else if constexpr (std::is_same_v<In, int16_t>)
+    {
+        if constexpr (std::is_same_v<Out, int32_t>)
+            return int32_t(v) * (1 << 16);
+        else
+            return v * (1.0f / (1 << 15));
+    }
+    else if constexpr (std::is_same_v<In, int32_t>)
+    {
+        if constexpr (std::is_same_v<Out, int16_t>)
+            return int16_t(v >> 16);
+        else
+            return v * (1.0f / (1U << 31));
+    }
+    else
+    {
+        // clamped before rounding, so that far out of range values saturate instead of overflowing lrint
+        if constexpr (std::is_same_v<Out, int16_t>)
+        {
+            return int16_t(std::lrintf(std::clamp(v * (1 << 15), -32768.f, 32767.f)));
+        }
+        else
+        {
+            v *= (1U << 31);
+            return v >= 2147483648.f ? INT32_MAX : int32_t(std::max<long long>(std::llrintf(v), INT32_MIN));
+        }
+    }
+}
+
+// the samples [first, last) one by one, used for the tails of the vector kernels as well
+template<typename In, bool inPlanar, typename Out, bool outPlanar>
+inline void convertRange(const uint8_t * const * in, uint8_t * const * out, int first, int last)
+{
+    auto lIn = (const In *)in[0];
+    auto rIn = inPlanar ? (const In *)in[1] : lIn + 1;
+    auto lOut = (Out *)out[0];
+    auto rOut = outPlanar ? (Out *)out[1] : lOut + 1;
+    constexpr int inStep = inPlanar ? 1 : 2;
+    constexpr int outStep = outPlanar ? 1 : 2;
+
+    for (int i = first; i < last; i++)
+    {
+        lOut[i * outStep] = convert<Out>(lIn[i * inStep]);
+        rOut[i * outStep] = convert<Out>(rIn[i * inStep]);
+    }
+}
+
+template<typename In, bool inPlanar, typename Out, bool outPlanar>
+void scalar(const uint8_t * const * in, uint8_t * const * out, int nbSamples)
+{
+    convertRange<In, inPlanar, Out, outPlanar>(in, out, 0, nbSamples);
+}
+
+template<typename In, bool inPlanar>
+inline ConvertKernel scalarFor(SampleLayout out)
+{
+    switch (out.kind)
+    {
+    case SampleKind::S16:
+        return out.planar ? &scalar<In, inPlanar, int16_t, true> : &scalar<In, inPlanar, int16_t, false>;
+    case SampleKind::S32:
+        return out.planar ? &scalar<In, inPlanar, int32_t, true> : &scalar<In, inPlanar, int32_t, false>;
+    case SampleKind::FLT:
+        return out.planar ? &scalar<In, inPlanar, float, true> : &scalar<In, inPlanar, float, false>;
+    }
+    return nullptr;
+}
+
+inline ConvertKernel scalarFor(SampleLayout in, SampleLayout out)
+{
+    switch (in.kind)
+    {
+    case SampleKind::S16:
+        return in.planar ? scalarFor<int16_t, true>(out) : scalarFor<int16_t, false>(out);
+    case SampleKind::S32:
+        return in.planar ? scalarFor<int32_t, true>(out) : scalarFor<int32_t, false>(out);
+    case SampleKind::FLT:
+        return in.planar ? scalarFor<float, true>(out) : scalarFor<float, false>(out);
+    }
+    return nullptr;
+}
+
+
+#if defined(SAMPLE_CONVERT_SSE2)
+
+// S16 LR pairs are 32-bit words L | R << 16: widening is a shift for L and a mask for R
+inline void s16ToS32pSse2(const uint8_t * const * in, uint8_t * const * out, int nbSamples)
+{
+    auto src = (const __m128i *)in[0];
+    auto l = (int32_t *)out[0];
+    auto r = (int32_t *)out[1];
+    const __m128i high = _mm_set1_epi32(int32_t(0xffff0000));
+    int i = 0;
+    for (; i + 4 <= nbSamples; i += 4)
+    {
+        __m128i v = _mm_loadu_si128(src++);
+        _mm_storeu_si128((__m128i *)(l + i), _mm_slli_epi32(v, 16));
+        _mm_storeu_si128((__m128i *)(r + i), _mm_and_si128(v, high));
+    }
+    convertRange<int16_t, false, int32_t, true>(in, out, i, nbSamples);
+}
+
+inline void s16pToS32pSse2(const uint8_t * const * in, uint8_t * const * out, int nbSamples)
+{
+    int i = 0;
+    for (; i + 8 <= nbSamples; i += 8)
+    {
+        for (int c = 0; c < 2; c++)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)((const int16_t *)in[c] + i));
+            auto dst = (int32_t *)out[c] + i;
+            _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(_mm_setzero_si128(), v));
+            _mm_storeu_si128((__m128i *)(dst + 4), _mm_unpackhi_epi16(_mm_setzero_si128(), v));
+        }
+    }
+    convertRange<int16_t, true, int32_t, true>(in, out, i, nbSamples);
+}
+
+// S32 and FLT move the same way
+template<typename T>
+inline void deinterleave32Sse2(const uint8_t * const * in, uint8_t * const * out, int nbSamples)
+{
+    auto src = (const int32_t *)in[0];
+    auto l = (int32_t *)out[0];
+    auto r = (int32_t *)out[1];
+    int i = 0;
+    for (; i + 4 <= nbSamples; i += 4)
+    {
+        // L0 L1 R0 R1, L2 L3 R2 R3
+        __m128i a = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(src + 2 * i)), _MM_SHUFFLE(3, 1, 2, 0));
+        __m128i b = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(src + 2 * i + 4)), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128((__m128i *)(l + i), _mm_unpacklo_epi64(a, b));
+        _mm_storeu_si128((__m128i *)(r + i), _mm_unpackhi_epi64(a, b));
+    }
+    convertRange<T, false, T, true>(in, out, i, nbSamples);
+}
+
+template<typename T>
+inline void interleave32Sse2(const uint8_t * const * in, uint8_t * const * out, int nbSamples)
+{
+    auto l = (const int32_t *)in[0];
+    auto r = (const int32_t *)in[1];
+    auto dst = (int32_t *)out[0];
+    int i = 0;
+    for (; i + 4 <= nbSamples; i += 4)
+    {
+        __m128i vl = _mm_loadu_si128((const __m128i *)(l + i));
+        __m128i vr = _mm_loadu_si128((const __m128i *)(r + i));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi32(vl, vr));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i + 4), _mm_unpackhi_epi32(vl, vr));
+    }
+    convertRange<T, true, T, false>(in, out, i, nbSamples);
+}
+
+// the high halves of L and R make the S16 LR pair
+inline void s32pToS16Sse2(const uint8_t * const * in, uint8_t * const * out, int nbSamples)
+{
+    auto l = (const int32_t *)in[0];
+    auto r = (const int32_t *)in[1];
+    auto dst = (__m128i *)out[0];
+    const __m128i high = _mm_set1_epi32(int32_t(0xffff0000));
+    int i = 0;
+    for (; i + 4 <= nbSamples; i += 4)
+    {
+        __m128i vl = _mm_srli_epi32(_mm_loadu_si128((const __m128i *)(l + i)), 16);
+        __m128i vr = _mm_and_si128(_mm_loadu_si128((const __m128i *)(r + i)), high);
+        _mm_storeu_si128(dst++, _mm_or_si128(vl, vr));
+    }
+    convertRange<int32_t, true, int16_t, false>(in, out, i, nbSamples);
+}
+
+// x * scale rounded to nearest even, a positive overflow turns the 0x80000000 of cvtps2dq into INT32_MAX
+inline __m128i fltToS32Sse2(__m128 v, __m128 scale)
+{
+    v = _mm_mul_ps(v, scale);
+    __m128i overflow = _mm_castps_si128(_mm_cmpge_ps(v, _mm_set1_ps(2147483648.f)));
+    return _mm_xor_si128(_mm_cvtps_epi32(v), overflow);
+}
+
+inline void fltpToS32Sse2(const uint8_t * const * in, uint8_t * const * out, int nbSamples)
+{
+    auto l = (const float *)in[0];
+    auto r = (const float *)in[1];
+    auto dst = (int32_t *)out[0];
+    const __m128 scale = _mm_set1_ps(2147483648.f);
+    int i = 0;
+    for (; i + 4 <= nbSamples; i += 4)
+    {
+        __m128i vl = fltToS32Sse2(_mm_loadu_ps(l + i), scale);
+        __m128i vr = fltToS32Sse2(_mm_loadu_ps(r + i), scale);
+        _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi32(vl, vr));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i + 4), _mm_unpackhi_epi32(vl, vr));
+    }
+    convertRange<float, true, int32_t, false>(in, out, i, nbSamples);
+}
+
+inline void fltpToS16Sse2(const uint8_t * const * in, uint8_t * const * out, int nbSamples)
+{
+    auto l = (const float *)in[0];
+    auto r = (const float *)in[1];
+    auto dst = (__m128i *)out[0];
+    const __m128 scale = _mm_set1_ps(32768.f);
+    int i = 0;
+    for (; i + 4 <= nbSamples; i += 4)
+    {
+        // packs saturates to the int16 range like av_clip_int16
+        __m128i vl = fltToS32Sse2(_mm_loadu_ps(l + i), scale);
+        __m128i vr = fltToS32Sse2(_mm_loadu_ps(r + i), scale);
+        __m128i lr0 = _mm_unpacklo_epi32(vl, vr);
+        __m128i lr1 = _mm_unpackhi_epi32(vl, vr);
+        _mm_storeu_si128(dst++, _mm_packs_epi32(lr0, lr1));
+    }
+    convertRange<float, true, int16_t, false>(in, out, i, nbSamples);
+}
+
+#endif // SAMPLE_CONVERT_SSE2
+
+
+#if defined(SAMPLE_CONVERT_AVX2)
+
+TARGET_AVX2
+inline void s16ToS32pAvx2(const uint8_t * const * in, uint8_t * const * out, int nbSamples)
+{
+    auto src = (const __m256i *)in[0];
+    auto l = (int32_t *)out[0];
+    auto r = (int32_t *)out[1];
+    const __m256i high = _mm256_set1_epi32(int32_t(0xffff0000));
+    int i = 0;
+    for (; i + 8 <= nbSamples; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256(src++);
+        _mm256_storeu_si256((__m256i *)(l + i), _mm256_slli_epi32(v, 16));
+        _mm256_storeu_si256((__m256i *)(r + i), _mm256_and_si256(v, high));
+    }
+    convertRange<int16_t, false, int32_t, true>(in, out, i, nbSamples);
+}
+
+template<typename T>
+TARGET_AVX2
+inline void deinterleave32Avx2(const uint8_t * const * in, uint8_t * const * out, int nbSamples)
+{
+    auto src = (const int32_t *)in[0];
+    auto l = (int32_t *)out[0];
+    auto r = (int32_t *)out[1];
+    const __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    int i = 0;
+    for (; i + 8 <= nbSamples; i += 8)
+    {
+        // L0..L3 R0..R3, L4..L7 R4..R7
+        __m256i a = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *)(src + 2 * i)), split);
+        __m256i b = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *)(src + 2 * i + 8)), split);
+        _mm256_storeu_si256((__m256i *)(l + i), _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i *)(r + i), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    convertRange<T, false, T, true>(in, out, i, nbSamples);
+}
+
+// L0 R0 L1 R1 | L4 R4 L5 R5 and L2 R2 L3 R3 | L6 R6 L7 R7 put back in order
+TARGET_AVX2
+inline void store32PairsAvx2(int32_t * dst, __m256i vl, __m256i vr)
+{
+    __m256i lo = _mm256_unpacklo_epi32(vl, vr);
+    __m256i hi = _mm256_unpackhi_epi32(vl, vr);
+    _mm256_storeu_si256((__m256i *)dst, _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i *)(dst + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+template<typename T>
+TARGET_AVX2
+inline void interleave32Avx2(const uint8_t * const * in, uint8_t * const * out, int nbSamples)
+{
+    auto l = (const int32_t *)in[0];
+    auto r = (const int32_t *)in[1];
+    auto dst = (int32_t *)out[0];
+    int i = 0;
+    for (; i + 8 <= nbSamples; i += 8)
+    {
+        store32PairsAvx2(dst + 2 * i, _mm256_loadu_si256((const __m256i *)(l + i)), _mm256_loadu_si256((const __m256i *)(r + i)));
+    }
+    convertRange<T, true, T, false>(in, out, i, nbSamples);
+}
+
+TARGET_AVX2
+inline void s32pToS16Avx2(const uint8_t * const * in, uint8_t * const * out, int nbSamples)
+{
+    auto l = (const int32_t *)in[0];
+    auto r = (const int32_t *)in[1];
+    auto dst = (__m256i *)out[0];
+    const __m256i high = _mm256_set1_epi32(int32_t(0xffff0000));
+    int i = 0;
+    for (; i + 8 <= nbSamples; i += 8)
+    {
+        __m256i vl = _mm256_srli_epi32(_mm256_loadu_si256((const __m256i *)(l + i)), 16);
+        __m256i vr = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(r + i)), high);
+        _mm256_storeu_si256(dst++, _mm256_or_si256(vl, vr));
+    }
+    convertRange<int32_t, true, int16_t, false>(in, out, i, nbSamples);
+}
+
+TARGET_AVX2
+inline __m256i fltToS32Avx2(__m256 v, __m256 scale)
+{
+    v = _mm256_mul_ps(v, scale);
+    __m256i overflow = _mm256_castps_si256(_mm256_cmp_ps(v, _mm256_set1_ps(2147483648.f), _CMP_GE_OQ));
+    return _mm256_xor_si256(_mm256_cvtps_epi32(v), overflow);
+}
+
+TARGET_AVX2
+inline void fltpToS32Avx2(const uint8_t * const * in, uint8_t * const * out, int nbSamples)
+{
+    auto l = (const float *)in[0];
+    auto r = (const float *)in[1];
+    auto dst = (int32_t *)out[0];
+    const __m256 scale = _mm256_set1_ps(2147483648.f);
+    int i = 0;
+    for (; i + 8 <= nbSamples; i += 8)
+    {
+        store32PairsAvx2(dst + 2 * i, fltToS32Avx2(_mm256_loadu_ps(l + i), scale), fltToS32Avx2(_mm256_loadu_ps(r + i), scale));
+    }
+    convertRange<float, true, int32_t, false>(in, out, i, nbSamples);
+}
+
+#endif // SAMPLE_CONVERT_AVX2
+
+
+#if defined(SAMPLE_CONVERT_AVX512)
+
+TARGET_AVX512
+inline void s16ToS32pAvx512(const uint8_t * const * in, uint8_t * const * out, int nbSamples)
+{
+    auto src = (const __m512i *)in[0];
+    auto l = (int32_t *)out[0];
+    auto r = (int32_t *)out[1];
+    const __m512i high = _mm512_set1_epi32(int32_t(0xffff0000));
+    int i = 0;
+    for (; i + 16 <= nbSamples; i += 16)
+    {
+        __m512i v = _mm512_loadu_si512(src++);
+        _mm512_storeu_si512(l + i, _mm512_slli_epi32(v, 16));
+        _mm512_storeu_si512(r + i, _mm512_and_si512(v, high));
+    }
+    convertRange<int16_t, false, int32_t, true>(in, out, i, nbSamples);
+}
+
+template<typename T>
+TARGET_AVX512
+inline void deinterleave32Avx512(const uint8_t * const * in, uint8_t * const * out, int nbSamples)
+{
+    auto src = (const int32_t *)in[0];
+    auto l = (int32_t *)out[0];
+    auto r = (int32_t *)out[1];
+    // the even and the odd words of the two registers
+    const __m512i even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+    const __m512i odd = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31);
+    int i = 0;
+    for (; i + 16 <= nbSamples; i += 16)
+    {
+        __m512i a = _mm512_loadu_si512(src + 2 * i);
+        __m512i b = _mm512_loadu_si512(src + 2 * i + 16);
+        _mm512_storeu_si512(l + i, _mm512_permutex2var_epi32(a, even, b));
+        _mm512_storeu_si512(r + i, _mm512_permutex2var_epi32(a, odd, b));
+    }
+    convertRange<T, false, T, true>(in, out, i, nbSamples);
+}
+
+TARGET_AVX512
+inline void store32PairsAvx512(int32_t * dst, __m512i vl, __m512i vr)
+{
+    const __m512i lo = _mm512_setr_epi32(0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23);
+    const __m512i hi = _mm512_setr_epi32(8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31);
+    _mm512_storeu_si512(dst, _mm512_permutex2var_epi32(vl, lo, vr));
+    _mm512_storeu_si512(dst + 16, _mm512_permutex2var_epi32(vl, hi, vr));
+}
+
+template<typename T>
+TARGET_AVX512
+inline void interleave32Avx512(const uint8_t * const * in, uint8_t * const * out, int nbSamples)
+{
+    auto l = (const int32_t *)in[0];
+    auto r = (const int32_t *)in[1];
+    auto dst = (int32_t *)out[0];
+    int i = 0;
+    for (; i + 16 <= nbSamples; i += 16)
+    {
+        store32PairsAvx512(dst + 2 * i, _mm512_loadu_si512(l + i), _mm512_loadu_si512(r + i));
+    }
+    convertRange<T, true, T, false>(in, out, i, nbSamples);
+}
+
+TARGET_AVX512
+inline void s32pToS16Avx512(const uint8_t * const * in, uint8_t * const * out, int nbSamples)
+{
+    auto l = (const int32_t *)in[0];
+    auto r = (const int32_t *)in[1];
+    auto dst = (__m512i *)out[0];
+    const __m512i high = _mm512_set1_epi32(int32_t(0xffff0000));
+    int i = 0;
+    for (; i + 16 <= nbSamples; i += 16)
+    {
+        __m512i vl = _mm512_srli_epi32(_mm512_loadu_si512(l + i), 16);
+        __m512i vr = _mm512_and_si512(_mm512_loadu_si512(r + i), high);
+        _mm512_storeu_si512(dst++, _mm512_or_si512(vl, vr));
+    }
+    convertRange<int32_t, true, int16_t, false>(in, out, i, nbSamples);
+}
+
+TARGET_AVX512
+inline __m512i fltToS32Avx512(__m512 v, __m512 scale)
+{
+    v = _mm512_mul_ps(v, scale);
+    __mmask16 overflow = _mm512_cmp_ps_mask(v, _mm512_set1_ps(2147483648.f), _CMP_GE_OQ);
+    return _mm512_mask_mov_epi32(_mm512_cvtps_epi32(v), overflow, _mm512_set1_epi32(INT32_MAX));
+}
+
+TARGET_AVX512
+inline void fltpToS32Avx512(const uint8_t * const * in, uint8_t * const * out, int nbSamples)
+{
+    auto l = (const float *)in[0];
+    auto r = (const float *)in[1];
+    auto dst = (int32_t *)out[0];
+    const __m512 scale = _mm512_set1_ps(2147483648.f);
+    int i = 0;
+    for (; i + 16 <= nbSamples; i += 16)
+    {
+        store32PairsAvx512(dst + 2 * i, fltToS32Avx512(_mm512_loadu_ps(l + i), scale), fltToS32Avx512(_mm512_loadu_ps(r + i), scale));
+    }
+    convertRange<float, true, int32_t, false>(in, out, i, nbSamples);
+}
+
+#endif // SAMPLE_CONVERT_AVX512
+
+} // namespace sample_convert
+
+
+// The kernel converting between the two layouts, nullptr for the same layout
+inline ConvertKernel findConvertKernel(SampleLayout in, SampleLayout out)
+{
+    using namespace sample_convert;
+
+    if (in.kind == out.kind && in.planar == out.planar)
+    {
+        return nullptr;
+    }
+
+    const auto is = [&in, &out] (SampleKind inKind, bool inPlanar, SampleKind outKind, bool outPlanar)
+    {
+        return in.kind == inKind && in.planar == inPlanar && out.kind == outKind && out.planar == outPlanar;
+    };
+
+#if defined(SAMPLE_CONVERT_AVX512)
+    if (simdLevel() >= SimdLevel::AVX512)
+    {
+        if (is(SampleKind::S16, false, SampleKind::S32, true)) return &s16ToS32pAvx512;
+        if (is(SampleKind::S32, false, SampleKind::S32, true)) return &deinterleave32Avx512<int32_t>;
+        if (is(SampleKind::FLT, false, SampleKind::FLT, true)) return &deinterleave32Avx512<float>;
+        if (is(SampleKind::S32, true, SampleKind::S32, false)) return &interleave32Avx512<int32_t>;
+        if (is(SampleKind::FLT, true, SampleKind::FLT, false)) return &interleave32Avx512<float>;
+        if (is(SampleKind::S32, true, SampleKind::S16, false)) return &s32pToS16Avx512;
+        if (is(SampleKind::FLT, true, SampleKind::S32, false)) return &fltpToS32Avx512;
+    }
+#endif
+#if defined(SAMPLE_CONVERT_AVX2)
+    if (simdLevel() >= SimdLevel::AVX2)
+    {
+        if (is(SampleKind::S16, false, SampleKind::S32, true)) return &s16ToS32pAvx2;
+        if (is(SampleKind::S32, false, SampleKind::S32, true)) return &deinterleave32Avx2<int32_t>;
+        if (is(SampleKind::FLT, false, SampleKind::FLT, true)) return &deinterleave32Avx2<float>;
+        if (is(SampleKind::S32, true, SampleKind::S32, false)) return &interleave32Avx2<int32_t>;
+        if (is(SampleKind::FLT, true, SampleKind::FLT, false)) return &interleave32Avx2<float>;
+        if (is(SampleKind::S32, true, SampleKind::S16, false)) return &s32pToS16Avx2;
+        if (is(SampleKind::FLT, true, SampleKind::S32, false)) return &fltpToS32Avx2;
+    }
+#endif
+#if defined(SAMPLE_CONVERT_SSE2)
+    if (is(SampleKind::S16, false, SampleKind::S32, true)) return &s16ToS32pSse2;
+    if (is(SampleKind::S16, true, SampleKind::S32, true)) return &s16pToS32pSse2;
+    if (is(SampleKind::S32, false, SampleKind::S32, true)) return &deinterleave32Sse2<int32_t>;
+    if (is(SampleKind::FLT, false, SampleKind::FLT, true)) return &deinterleave32Sse2<float>;
+    if (is(SampleKind::S32, true, SampleKind::S32, false)) return &interleave32Sse2<int32_t>;
+    if (is(SampleKind::FLT, true, SampleKind::FLT, false)) return &interleave32Sse2<float>;
+    if (is(SampleKind::S32, true, SampleKind::S16, false)) return &s32pToS16Sse2;
+    if (is(SampleKind::FLT, true, SampleKind::S32, false)) return &fltpToS32Sse2;
+    if (is(SampleKind::FLT, true, SampleKind::S16, false)) return &fltpToS16Sse2;
+#endif
+    return scalarFor(in, out);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+
+// Bounded lock-free single-producer/single-consumer ring.
+// push() must be called by one producer at a time and pop() by one consumer at a time, each one's calls ordered
+// one after another (as the runs of a StageTasks stage are), not necessarily on the same thread.
+template<typename T>
+class SpscQueue
+{
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue operator=(const SpscQueue &) = delete;
+public:
+    explicit SpscQueue(size_t capacity)
+        : buffer_(capacity + 1)     // one slot is kept empty to tell full from empty
+    {}
+
+    bool push(const T & v)
+    {
+        const auto head = head_.load(std::memory_order_relaxed);
+        const auto next = head + 1 == buffer_.size() ? 0 : head + 1;
+        if (next == tail_.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        buffer_[head] = v;
+        head_.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T & v)
+    {
+        const auto tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        v = buffer_[tail];
+        tail_.store(tail + 1 == buffer_.size() ? 0 : tail + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::vector<T>                  buffer_;
+    alignas(64) std::atomic<size_t> head_ { 0 };
+    alignas(64) std::atomic<size_t> tail_ { 0 };
+};
@@ -11,26 +11,53 @@ extern "C" {
 #endif
 
 #include <filesystem>
+#include <optional>
+#include <functional>
+#include <mutex>
+#include <unordered_set>
 
 #include "log.hpp"
 #include "utils.h"
 #include "star_echo.h"
 #include "threaded.h"
+#include "concurrency.h"
 #include "mediaProcess.h"
+#include "cpuFeatures.h"
+#include "denormals.h"
+#include "benchmark.h"
+#include "manifest.h"
+#include "isolate.h"
 
 namespace po = boost::program_options;
 
+// directories listed at once, the scan waits on the storage rather than the CPU
+static constexpr int ScanThreads = 8;
+
 static const std::array<std::string, 9> fileExts_ { ".aac", ".gsm", ".wav", ".wavpack", ".ass", ".tta",".flac", ".wma", ".mp3" };
 
 
-static std::filesystem::path outputFilePath(const std::filesystem::path & inputPath, const std::filesystem::path & outputOptional)
+static bool isMusicFile(const std::filesystem::path & path)
 {
-    if (inputPath.has_extension()
+    return path.has_extension()
         && std::find_if(fileExts_.begin(), fileExts_.end(),
-                        [ext = inputPath.extension().string()](const std::string & r)
+                        [ext = path.extension().string()](const std::string & r)
     {
         return boost::iequals(ext, r);
-    }) != fileExts_.end())
+    }) != fileExts_.end();
+}
+
+bool isInDirectory(const std::filesystem::path & child, const std::filesystem::path & root)
+{
+    std::filesystem::path normRoot = root;//std::filesystem::canonical(root);
+    std::filesystem::path normChild = child;//std::filesystem::canonical(child);
+    auto itr = std::search(normChild.begin(), normChild.end(),
+                           normRoot.begin(), normRoot.end());
+    return itr == normChild.begin();
+}
+
+static std::filesystem::path outputFilePath(const std::filesystem::path & inputPath, const std::filesystem::path & outputOptional)
+{
+    if (isMusicFile(inputPath))
     {
         std::filesystem::path outputPath;
         if (outputOptional.empty())
@@ -49,13 +76,205 @@ static std::filesystem::path outputFilePath(const std::filesystem::path & inputP
 }
 
 
-bool isInDirectory(const std::filesystem::path & child, const std::filesystem::path & root)
+// Longest processing time first: the long files start early and the short ones fill in at the end, so that a long
+// file found last does not keep one thread busy after the others are done. The length of a file is the duration
+// in its header, else its size at the bytes per second of the files found so far that have one. "interleave"
+// alternates between the longest and the shortest files waiting for an even load on the disk. The item keeps the
+// sample rate and the frame size of the header for the memory estimate of --max-memory
+class JobLengths
 {
-    std::filesystem::path normRoot = root;//std::filesystem::canonical(root);
-    std::filesystem::path normChild = child;//std::filesystem::canonical(child);
-    auto itr = std::search(normChild.begin(), normChild.end(),
-                           normRoot.begin(), normRoot.end());
-    return itr == normChild.begin();
+public:
+    double operator()(FileItem & item)
+    {
+        std::error_code ec;
+        uintmax_t bytes = std::filesystem::file_size(item.input, ec);
+        if (ec)
+        {
+            bytes = 0;
+        }
+        const MediaProbe probe = probeMedia(item.input);
+        item.sampleRate = probe.sampleRate;
+        item.frameSize = probe.frameSize;
+        const double seconds = probe.seconds;
+
+        std::lock_guard lock(mtx_);
+        if (seconds > 0)
+        {
+            knownSeconds_ += seconds;
+            knownBytes_ += double(bytes);
+            return seconds;
+        }
+        // CD audio if no header told so far
+        const double bytesPerSecond = knownSeconds_ > 0 ? knownBytes_ / knownSeconds_ : 44100. * 4;
+        return double(bytes) / bytesPerSecond;
+    }
+
+private:
+    std::mutex  mtx_;
+    double      knownSeconds_ = 0;
+    double      knownBytes_ = 0;
+};
+
+
+// Finds the music files under the input directories while the files found so far are processed. Every directory
+// is a task of the scan's pool that lists it once and makes tasks of its subdirectories, so that slow storage is
+// read in parallel. Which outputs are already there is taken from one listing of the output directory instead
+// of a lookup per file. The files go to found() on the scan threads, with whether their output is there
+class DirectoryScan
+{
+    DirectoryScan(const DirectoryScan &) = delete;
+    DirectoryScan operator=(const DirectoryScan &) = delete;
+public:
+    using Found = std::function<void(FileItem, bool)>;
+
+    // with overwrite the outputs are not looked for
+    DirectoryScan(int threads, bool keepFormat, bool overwrite, bool normalize, Found found)
+        : keepFormat_(keepFormat), overwrite_(overwrite), normalize_(normalize)
+        , found_(std::move(found))
+        , pool_(threads)
+        , tasks_(&pool_)
+    {}
+
+    // The files under input go to the same relative paths under output, whatever is under output is skipped
+    void addDirectory(const std::filesystem::path & input, const std::filesystem::path & output)
+    {
+        if (!isInDirectory(input, output))
+        {
+            tasks_.run([this, input, output] { scan(input, input, output); });
+        }
+    }
+
+    // A file given by name goes the same way as the files found
+    void addFile(FileItem item, bool outputExists)
+    {
+        tasks_.run([this, item = std::move(item), outputExists] () mutable
+                   {
+                       found_(std::move(item), outputExists);
+                       pool_.notify();
+                   });
+    }
+
+    // Returns when stop() or the scan is done, stop() is checked after every batch of files found
+    template<typename Stop>
+    void waitUntil(Stop && stop)
+    {
+        pool_.help([&] { return tasks_.done() || stop(); });
+    }
+
+    void wait() { tasks_.wait(); }
+    bool done() const { return tasks_.done(); }
+
+private:
+    static constexpr size_t FoundBatch = 32;
+
+    using Names = std::unordered_set<std::filesystem::path::string_type>;
+
+    void scan(const std::filesystem::path & dir, const std::filesystem::path & root, const std::filesystem::path & output)
+    {
+        std::vector<std::filesystem::path> files;
+        std::error_code ec;
+        for (std::filesystem::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec))
+        {
+            std::error_code typeEc;
+            const auto & entry = *it;
+            // like a recursive iterator, linked directories are not followed
+            if (entry.is_directory(typeEc) && !entry.is_symlink(typeEc))
+            {
+                if (!isInDirectory(entry.path(), output))
+                {
+                    tasks_.run([this, sub = entry.path(), root, output] { scan(sub, root, output); });
+                }
+            }
+            else if (entry.is_regular_file(typeEc) && isMusicFile(entry.path()))
+            {
+                files.push_back(entry.path());
+            }
+        }
+        if (ec)
+        {
+            err() << "cannot read " << dir.string() << " : " << ec.message();
+        }
+        if (files.empty())
+        {
+            return;
+        }
+
+        const auto outputDir = output / dir.lexically_relative(root);
+        Names existing;
+        if (!overwrite_)
+        {
+            for (std::filesystem::directory_iterator it(outputDir, ec), end; !ec && it != end; it.increment(ec))
+            {
+                existing.insert(name(it->path()));
+            }
+        }
+        std::vector<std::pair<FileItem, bool>> items;
+        for (auto & inputFile : files)
+        {
+            auto outputFile = outputDir / inputFile.filename();
+            if (!keepFormat_)
+            {
+                outputFile.replace_extension(".flac");
+            }
+            const bool exists = existing.count(name(outputFile)) > 0;
+            items.emplace_back(FileItem { inputFile, outputFile, normalize_ }, exists);
+        }
+        // found() may read the files, a large directory is handed over in parallel
+        for (size_t first = 0; first < items.size(); first += FoundBatch)
+        {
+            std::vector<std::pair<FileItem, bool>> batch(std::make_move_iterator(items.begin() + first),
+                                                         std::make_move_iterator(items.begin() + std::min(items.size(), first + FoundBatch)));
+            tasks_.run([this, batch = std::move(batch)] () mutable
+                       {
+                           for (auto & [item, exists] : batch)
+                           {
+                               found_(std::move(item), exists);
+                           }
+                           pool_.notify();
+                       });
+        }
+    }
+
+    // the file names compare like the file system does
+    static std::filesystem::path::string_type name(const std::filesystem::path & path)
+    {
+        auto name = path.filename().native();
+    #if defined(_WIN32)
+        boost::algorithm::to_lower(name);
+    #endif
+        return name;
+    }
+
+    const bool  keepFormat_;
+    const bool  overwrite_;
+    const bool  normalize_;
+    Found       found_;
+    WorkPool    pool_;
+    TaskGroup   tasks_;
+};
+
+
+// Bytes of a size with an optional K, M or G suffix, a plain number is in megabytes
+static bool parseBytes(const std::string & text, size_t & bytes)
+{
+    char * end = nullptr;
+    double value = std::strtod(text.c_str(), &end);
+    if (end == text.c_str() || value < 0)
+    {
+        return false;
+    }
+    std::string suffix = boost::algorithm::to_upper_copy(std::string(end));
+    double unit = 0;
+    if (suffix.empty() || suffix == "M" || suffix == "MB")
+        unit = 1 << 20;
+    else if (suffix == "K" || suffix == "KB")
+        unit = 1 << 10;
+    else if (suffix == "G" || suffix == "GB")
+        unit = 1 << 30;
+    else
+        return false;
+    bytes = size_t(value * unit);
+    return true;
 }
 
 #if defined(_WIN32)
@@ -104,6 +323,33 @@ int main(int argc, char ** argv)
     bool overwrite = false;
     bool normalize = false;
     int silence = -1;
+    bool pipeline = false;
+    int filterStages = 1;
+    int tileSamples = 0;
+    int lanes = 0;
+    int segments = 0;
+    int warmup = 10;
+    bool verifySegments = false;
+    std::string simd;
+    std::string denormals = "ftz";
+    bool benchDenormals = false;
+    bool singlePrecision = false;
+    bool benchPrecision = false;
+    bool selfCheckOnly = false;
+    bool benchLanes = false;
+    bool int16 = false;
+    std::string order = "longest";
+    std::string maxMemory;
+    ustring manifestFile;
+    ustring cacheDir;
+    ustring pcmCacheDir;
+    std::string cacheSize = "10G";
+    std::string pcmCacheSize = "10G";
+    bool isolate = false;
+    int jobTimeout = 1800;
+    std::string jobMemory;
+    bool isolateWorker = false;
+    int isolateThreads = 1;
 
     po::variables_map opts_map;
     po::options_description options("Options");
@@ -111,11 +357,36 @@ int main(int argc, char ** argv)
         ("help,h", "Display the help message.")
         ("input,i", uvalue(&input)->composing(), "Input file(s)/directory.\n- [Default: the current directory]")
         ("output,o", uvalue(&output), "If the input is a directory, then output should be a directory.\nIf the input is a file, then the output should be a filename.\nIf the inputs are multiple files, then this option is ignored.\n- [Default: './FINAL' directory]")
-        ("threads,t", po::value(&threads), "The number of CPU threads to run.\n- [Default: the processor's available total cores]")
+        ("threads,t", po::value(&threads), "The number of CPU threads to run.\n- [Default: adjusted while running by the measured throughput, up to the available cores and starting from the container's CPU quota]")
         ("keep-format,k", po::bool_switch(&keepFormat), "Keep each output file's format the same as its source file's.\n- [Default: the output format is .flac]")
         ("overwrite,w", po::bool_switch(&overwrite), "Overwrite output file if it exists [Default: false]")
         ("normalize,n", po::bool_switch(&normalize), "Normalize the sound to avoid rips [Default: false]")
         ("silence,s", po::value(&silence), "Append silence in seconds [Default: 0]")
+        ("pipeline,p", po::bool_switch(&pipeline), "Decode, filter and encode each file in parallel, as separate tasks of the worker threads.\n- [Default: only when there are fewer files than CPU threads]")
+        ("filter-stages", po::value(&filterStages), "Split the filter chain into up to this many stages run in parallel, balanced by the measured cost of each filter. Implies --pipeline.\n- [Default: 1]")
+        ("tile", po::value(&tileSamples), "Samples that go through the whole filter chain at a time.\n- [Default: 0, picked from the L1 cache size]")
+        ("order", po::value(&order), "The order the files are processed in: longest (the longest first by the duration in their headers or their size), interleave (the longest and the shortest in turn) or scan (as found).\n- [Default: longest]")
+        ("max-memory", po::value(&maxMemory), "Start a file only while the memory estimated for the files in work stays within this size, in megabytes or with a K, M or G suffix. A file larger than the limit runs alone.\n- [Default: no limit]")
+        ("manifest", uvalue(&manifestFile), "Record the files processed with their size, time, content hash and filters in this file, and process only the new and changed ones and those made by other filters. 'auto' is .star_echo.manifest in the output directory of the first directory input.\n- [Default: none, an output that is there counts as done]")
+        ("cache", uvalue(&cacheDir), "Keep the rendered files in this directory by the content of their source, the filters and the format, and link the ones rendered before instead of rendering them again. Also read from STAR_ECHO_CACHE.\n- [Default: none]")
+        ("cache-size", po::value(&cacheSize), "The size the rendered files may take in the --cache directory, the least recently used go first. In megabytes or with a K, M or G suffix.\n- [Default: 10G]")
+        ("pcm-cache", uvalue(&pcmCacheDir), "Keep the decoded sources in this directory, so that rendering them again with other filters skips decoding.\n- [Default: none]")
+        ("pcm-cache-size", po::value(&pcmCacheSize), "The size the decoded sources may take, the least recently used go first. In megabytes or with a K, M or G suffix.\n- [Default: 10G]")
+        ("isolate", po::bool_switch(&isolate), "Process each file in a worker process instead of a thread, so that a file that crashes or hangs the decoder fails alone. The workers are restarted and the failed files listed at the end. With fewer files than threads, the threads are shared out among the workers for --pipeline and --segments. Not on Windows.\n- [Default: false]")
+        ("job-timeout", po::value(&jobTimeout), "With --isolate, the seconds a file may take before its worker is killed, 0 for no limit.\n- [Default: 1800]")
+        ("job-memory", po::value(&jobMemory), "With --isolate, the memory a worker may take, in megabytes or with a K, M or G suffix.\n- [Default: no limit]")
+        ("lanes", po::value(&lanes), "Filter up to this many files (4 or 8) in lockstep, one per SIMD lane. Only for chains of EQ filters, the others have no lane kernel. Needs as many threads and takes precedence over --pipeline.\n- [Default: 0, off]")
+        ("segments", po::value(&segments), "Split each file into this many time segments filtered in parallel.\n- [Default: 0, off]")
+        ("warmup", po::value(&warmup), "Seconds each segment starts early for the filters to settle before the splice [Default: 10]")
+        ("verify-segments", po::bool_switch(&verifySegments), "Report the error of the spliced segments against sequential processing [Default: false]")
+        ("denormals", po::value(&denormals), "How the float filter chain keeps out of slow subnormal numbers in the decaying tails: ftz (flush them to zero), noise (add inaudible noise) or off.\n- [Default: ftz]")
+        ("bench-denormals", po::bool_switch(&benchDenormals), "Measure the float chain of the given filters over music and a silent tail with each --denormals mode, then exit")
+        ("single-precision", po::bool_switch(&singlePrecision), "Filter float sources in single precision, the recursive filter states stay in double.\n- [Default: false, double precision]")
+        ("int16", po::bool_switch(&int16), "Filter and write 16-bit sources in 16-bit integers, faster in lockstep with --lanes. The output carries a DC offset of about -26 LSB against the 32-bit chain.\n- [Default: false, 16-bit sources are filtered in 32 bits like the others]")
+        ("bench-precision", po::bool_switch(&benchPrecision), "Report the error and the speed of the given filters in single precision against double, then exit")
+        ("bench-lanes", po::bool_switch(&benchLanes), "Measure the given filters over 4 and 8 files in lockstep against file by file, then exit")
+        ("self-check", po::bool_switch(&selfCheckOnly), "Check the SIMD code paths against the plain ones at each instruction set the processor has the --denormals modes of the given filters against each other and the --int16 chain against the 32-bit one, then exit with 1 if any differs")
+        ("simd", po::value(&simd), "Instruction set of the DSP kernels: sse2, avx2 or avx512. Also read from STAR_ECHO_SIMD.\n- [Default: the best the processor supports]")
         ("filter,f", po::value(&filters), "\
 Filter(s) to be applied:\n\
  CH[,roomSize[,gain]] - Cathedral,\n\
@@ -141,14 +412,21 @@ Predefined filters:\n\
  cathedral,\n\
  upscaling")
 ;
+    // started by --isolate, not shown in the help
+    po::options_description internal;
+    internal.add_options()
+        ("isolate-worker", po::bool_switch(&isolateWorker), "Process the files the parent process sends")
+        ("isolate-threads", po::value(&isolateThreads), "The threads of the worker process's pool");
+    po::options_description allOptions;
+    allOptions.add(options).add(internal);
     po::positional_options_description posd;
     posd.add("input", -1);
     try
     {
         #if defined(_WIN32)
-        po::store(po::wcommand_line_parser(argc, argv).options(options).positional(posd).run(), opts_map);
+        po::store(po::wcommand_line_parser(argc, argv).options(allOptions).positional(posd).run(), opts_map);
         #else
-        po::store(po::command_line_parser(argc, argv).options(options).positional(posd).run(), opts_map, false);
+        po::store(po::command_line_parser(argc, argv).options(allOptions).positional(posd).run(), opts_map, false);
         #endif
         po::notify(opts_map);
     }
@@ -165,11 +443,157 @@ Predefined filters:\n\
         return 0;
     }
 
+    if (!simd.empty())
+    {
+        SimdLevel level;
+        if (!parseSimdLevel(simd, level))
+        {
+            err() << "ERROR: unknown --simd level " << simd;
+            return -1;
+        }
+        if (setSimdLevel(level) != level)
+        {
+            msg() << "The processor does not support " << simd << ", using " << simdLevelName(simdLevel());
+        }
+    }
+
+    if (filters.empty())
+    {
+        filters.push_back("ch");
+        if (silence == -1)
+           silence = 3;
+    }
+    if (silence == -1)
+        silence = 0;
+
+    FilterFabric fab(!normalize, silence);
+    fab.setSinglePrecision(singlePrecision);
+    fab.setInt16Chain(int16);
+    for (const auto & desc : filters)
+    {
+        auto r = fab.addDesc(stringToWstring(desc));
+
+        if (!r)
+        {
+            return -1;
+        }
+    }
+
+    DenormalMode denormalMode;
+    if (!parseDenormalMode(denormals, denormalMode))
+    {
+        err() << "ERROR: unknown --denormals mode " << denormals;
+        return -1;
+    }
+
+    if (benchDenormals)
+    {
+        return benchmarkDenormals(fab);
+    }
+    if (benchPrecision)
+    {
+        return benchmarkPrecision(fab);
+    }
+    if (benchLanes)
+    {
+        return benchmarkLanes(fab);
+    }
+    if (selfCheckOnly)
+    {
+        return selfCheck(fab);
+    }
+
+#if defined(_DEBUG)
+    av_log_set_level(AV_LOG_WARNING);
+    //av_log_set_level(99);
+#else
+    av_log_set_level(AV_LOG_FATAL);
+#endif
+
+    ProcessOptions processOptions;
+    if (!maxMemory.empty() && !parseBytes(maxMemory, processOptions.maxMemory))
+    {
+        err() << "ERROR: invalid --max-memory " << maxMemory;
+        return -1;
+    }
+    // spare cores are put to work inside each file
+    processOptions.filterStages = std::max(1, filterStages);
+    if (lanes > 1 && !fab.hasLaneKernels())
+    {
+        msg() << "--lanes is off: only the EQ filters have lane kernels, the other filters would run the files one after another";
+        lanes = 0;
+    }
+    processOptions.lanes = lanes;
+    processOptions.denormals = denormalMode;
+    processOptions.tileSamples = std::max(0, tileSamples);
+    processOptions.segments = segments;
+    processOptions.warmup = std::max(0, warmup);
+    processOptions.verifySegments = verifySegments;
+    if (cacheDir.empty())
+    {
+        if (const char * env = std::getenv("STAR_ECHO_CACHE"))
+        {
+            cacheDir = ustring(env, env + std::strlen(env));
+        }
+    }
+    if (!cacheDir.empty())
+    {
+        if (!parseBytes(cacheSize, processOptions.cacheBytes))
+        {
+            err() << "ERROR: invalid --cache-size " << cacheSize;
+            return -1;
+        }
+        processOptions.cache = std::filesystem::absolute(cacheDir);
+    }
+    if (!pcmCacheDir.empty())
+    {
+        if (!parseBytes(pcmCacheSize, processOptions.pcmCacheBytes))
+        {
+            err() << "ERROR: invalid --pcm-cache-size " << pcmCacheSize;
+            return -1;
+        }
+        processOptions.pcmCache = std::filesystem::absolute(pcmCacheDir);
+    }
+
+#if defined(_WIN32)
+    if (isolate)
+    {
+        msg() << "--isolate is not supported on Windows, the files are processed in threads";
+        isolate = false;
+    }
+#else
+    IsolatedProcess::Limits limits;
+    limits.timeout = std::max(0, jobTimeout);
+    if (!jobMemory.empty() && !parseBytes(jobMemory, limits.memory))
+    {
+        err() << "ERROR: invalid --job-memory " << jobMemory;
+        return -1;
+    }
+
+    if (isolateWorker)
+    {
+        // one file at a time, the parent keeps the record of them and admits them by --max-memory
+        processOptions.lanes = 0;
+        processOptions.maxMemory = 0;
+        processOptions.pipeline = pipeline || processOptions.filterStages > 1;
+        bool written = false;
+        uint64_t content = 0;
+        processOptions.finished = [&written, &content] (const FileItem &, bool w, uint64_t c) { written = w; content = c; };
+        MediaProcess process(fab, processOptions);
+        // the segments and the pipeline stages of a file run on the threads the parent shares out to this worker
+        WorkPool pool(std::max(1, isolateThreads));
+        return serveIsolatedJobs(process, pool, written, content);
+    }
+#endif
+
     // nothing:  ./
     // directory
     // file1 [file2 file3]
 
-    std::vector<FileItem> inputFiles;
+    // the files given by name with whether their output is there, the directories are scanned while their
+    //  files are processed
+    std::vector<std::pair<FileItem, bool>> inputFiles;
+    std::vector<std::pair<std::filesystem::path, std::filesystem::path>> directories;
 
     if (input.empty())
     {
@@ -187,33 +611,7 @@ Predefined filters:\n\
             }
             std::filesystem::path outputPath = std::filesystem::absolute(output);
 
-            for (auto const & dir_entry : std::filesystem::recursive_directory_iterator { inputPath })
-            {
-                if (dir_entry.is_regular_file() && dir_entry.path().has_extension()
-                    && !isInDirectory(dir_entry.path(), outputPath)) // skip files in the output directory
-                {
-                    std::filesystem::path inputFile = dir_entry.path();
-
-                    // filter by file extension
-                    if (std::find_if(fileExts_.begin(), fileExts_.end(), [ext = inputFile.extension().string()](const std::string & r)
-                    {
-                        return boost::iequals(ext, r);
-                    }) != fileExts_.end())
-                    {
-                        auto relParent = inputFile.lexically_relative(inputPath);
-                        auto outputFile = (outputPath / relParent);
-
-                        if (!keepFormat)
-                        {
-                            outputFile.replace_extension(".flac");
-                        }
-                        if (overwrite || !std::filesystem::exists(outputFile))    // if the file was already converted in the past, skip
-                        {
-                            inputFiles.push_back({ inputFile, outputFile, normalize });
-                        }
-                    }
-                }
-            }
+            directories.emplace_back(inputPath, outputPath);
         }
         else if (std::filesystem::is_regular_file(inputPath))
         {
@@ -225,10 +623,7 @@ Predefined filters:\n\
                 {
                     outputFile.replace_extension(".flac");
                 }
-                if (overwrite || !std::filesystem::exists(outputFile))    // if the file was already converted in the past, skip
-                {
-                    inputFiles.push_back({ inputPath, outputFile, normalize });
-                }
+                inputFiles.emplace_back(FileItem { inputPath, outputFile, normalize }, !overwrite && std::filesystem::exists(outputFile));
             }
         }
         else
@@ -238,43 +633,192 @@ Predefined filters:\n\
         }
     }
 
-    if (inputFiles.empty())
+    // without a thread count the pool has a thread per available core, as many as the CPU quota of the
+    //  container allows take work at first and the controller adjusts them by the throughput
+    const bool adaptive = threads <= 0;
+    const double cpuLimit = cgroupCpuLimit();
+    int activeThreads = 0;
+    if (adaptive)
+    {
+        threads = availableCpus();
+        activeThreads = cpuLimit > 0 ? std::clamp(int(std::ceil(cpuLimit)), 1, threads) : threads;
+    }
+    else
+    {
+        activeThreads = threads;
+    }
+
+    if (order != "longest" && order != "interleave" && order != "scan")
+    {
+        err() << "ERROR: unknown --order " << order;
+        return -1;
+    }
+
+    std::unique_ptr<Manifest> manifest;
+    if (manifestFile == U("auto"))
+    {
+        if (directories.empty())
+        {
+            err() << "ERROR: --manifest auto needs a directory input";
+            return -1;
+        }
+        manifestFile = (directories.front().second / ".star_echo.manifest").native();
+    }
+    if (!manifestFile.empty())
+    {
+        manifest = std::make_unique<Manifest>(std::filesystem::absolute(manifestFile), chainDescription(fab, processOptions));
+    }
+
+    // the files found wait here until the worker runs, then they go right to it
+    std::mutex foundMtx;
+    std::vector<std::pair<FileItem, double>> found;
+    std::function<void(FileItem, double)> running;
+    JobLengths lengths;
+    DirectoryScan scan(ScanThreads, keepFormat, overwrite, normalize, [&] (FileItem item, bool outputExists)
+                       {
+                           // an output that is there was converted in the past, unless the manifest knows better
+                           if (!overwrite && (manifest ? !manifest->needed(item.input, outputExists) : outputExists))
+                           {
+                               return;
+                           }
+                           // the header is read once, for the order and for the memory estimate
+                           double length = 0;
+                           if (order != "scan" || processOptions.maxMemory > 0)
+                           {
+                               length = lengths(item);
+                           }
+                           if (order == "scan")
+                           {
+                               length = 0;
+                           }
+                           std::lock_guard lock(foundMtx);
+                           if (running)
+                           {
+                               running(std::move(item), length);
+                           }
+                           else
+                           {
+                               found.emplace_back(std::move(item), length);
+                           }
+                       });
+    for (auto & [item, exists] : inputFiles)
+    {
+        scan.addFile(std::move(item), exists);
+    }
+    for (auto & [inputPath, outputPath] : directories)
+    {
+        scan.addDirectory(inputPath, outputPath);
+    }
+
+    // whether there are fewer files than threads decides how to run them, the rest of the scan does not matter
+    size_t foundFiles = 0;
+    scan.waitUntil([&]
+                   {
+                       std::lock_guard lock(foundMtx);
+                       foundFiles = found.size();
+                       return foundFiles >= size_t(activeThreads);
+                   });
+    const bool fewFiles = scan.done() && foundFiles < size_t(activeThreads);
+    if (scan.done() && foundFiles == 0)
     {
         msg() << "No new music files are found for processing";
         return 0;
     }
 
-    if (filters.empty())
+    processOptions.pipeline = lanes <= 1 && (pipeline || processOptions.filterStages > 1 || fewFiles);
+    if (manifest)
     {
-        filters.push_back("ch");
-        if (silence == -1)
-           silence = 3;
+        processOptions.finished = [&manifest] (const FileItem & item, bool written, uint64_t content) { manifest->finished(item.input, written, content); };
     }
-    if (silence == -1)
-        silence = 0;
 
-    FilterFabric fab(!normalize, silence);
-    for (const auto & desc : filters)
+    // hands the files found so far and then those found later to the worker until the scan ends
+    auto run = [&] (auto & worker)
     {
-        auto r = fab.addDesc(stringToWstring(desc));
+        {
+            std::lock_guard lock(foundMtx);
+            for (auto & [item, length] : found)
+            {
+                worker.add(std::move(item), length);
+            }
+            found.clear();
+            running = [&worker] (FileItem item, double length) { worker.add(std::move(item), length); };
+        }
+        scan.wait();
+        worker.close();
+        worker.waitForDone();
+    };
 
-        if (!r)
+#if !defined(_WIN32)
+    if (isolate)
+    {
+        // the workers are this program with the same options, the filters and the caches go with them
+        std::vector<std::string> command;
+        std::error_code ec;
+        auto self = std::filesystem::read_symlink("/proc/self/exe", ec);
+        command.push_back(ec ? std::string(argv[0]) : self.string());
+        command.insert(command.end(), argv + 1, argv + argc);
+        command.push_back("--isolate-worker");
+        // a switch given twice is an error, the workers already have it when the user gave it
+        if (processOptions.pipeline && !pipeline)
         {
-            return -1;
+            command.push_back("--pipeline");
+        }
+        if (lanes > 1)
+        {
+            msg() << "--lanes is not used with --isolate";
+        }
+        // a worker per file in work, those of fewer files than threads have the other threads to share
+        const int workerThreads = fewFiles ? std::max(1, activeThreads / int(foundFiles)) : 1;
+        command.push_back("--isolate-threads");
+        command.push_back(std::to_string(workerThreads));
+        if (workerThreads == 1 && processOptions.segments > 1)
+        {
+            msg() << "--segments: with --isolate and a file for every thread, the segments of a file run one after another";
         }
-    }
 
-#if defined(_DEBUG)
-    av_log_set_level(AV_LOG_WARNING);
-    //av_log_set_level(99);
-#else
-    av_log_set_level(AV_LOG_FATAL);
+        // the files in work in all the workers are estimated here by the options the workers run under
+        std::unique_ptr<MediaProcess> estimate;
+        if (processOptions.maxMemory > 0)
+        {
+            ProcessOptions estimateOptions = processOptions;
+            estimateOptions.lanes = 0;
+            estimateOptions.pipeline = processOptions.pipeline || pipeline || processOptions.filterStages > 1;
+            estimateOptions.maxMemory = 0;
+            estimateOptions.cache.clear();
+            estimateOptions.pcmCache.clear();
+            estimate = std::make_unique<MediaProcess>(fab, estimateOptions);
+            limits.maxMemory = processOptions.maxMemory;
+            limits.footprint = [&estimate] (const FileItem & item) { return estimate->footprint(item); };
+        }
+
+        // the samples are decoded in the workers where the controller does not see them
+        auto processor = std::make_unique<IsolatedProcess>(command, threads, limits, processOptions.finished);
+        IsolatedProcess & isolated = *processor;
+        ThreadedWorker<FileItem, IsolatedProcess> worker(processor, threads, activeThreads, order == "interleave");
+        run(worker);
+
+        auto failures = isolated.failures();
+        if (!failures.empty())
+        {
+            err() << failures.size() << " file(s) failed:";
+            for (auto & input : failures)
+            {
+                err() << "  " << input.string();
+            }
+        }
+        return 0;
+    }
 #endif
 
-    auto processor = std::make_unique<MediaProcess>(fab);
+    auto processor = std::make_unique<MediaProcess>(fab, processOptions);
     //msg() << processor->operator()(inputFiles[0]);
-    ThreadedWorker<FileItem, MediaProcess> worker(inputFiles, processor, threads);
-    worker.waitForDone();
+    ThreadedWorker<FileItem, MediaProcess> worker(processor, threads, activeThreads, order == "interleave");
+    std::optional<ConcurrencyController> controller;
+    if (adaptive && threads > 1)
+    {
+        controller.emplace(worker.pool(), cpuLimit);
+    }
+    run(worker);
 
     return 0;
 }
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <boost/circular_buffer.hpp>
+
+#include "bufferArena.h"
+
+
+// The memory of a whole filter chain: the filter objects, their delay lines and states one after another,
+// in the order the chain makes them. It is filled while a Scope is open on the building thread, what the
+// filters allocate later goes to the heap. The arena is freed with the last object and buffer it holds
+class StateArena
+{
+    StateArena(const StateArena &) = delete;
+    StateArena operator=(const StateArena &) = delete;
+public:
+    // The filters and buffers created on the calling thread during the lifetime of the scope go to a new arena
+    class Scope
+    {
+        Scope(const Scope &) = delete;
+        Scope operator=(const Scope &) = delete;
+    public:
+        Scope()
+            : arena_(new StateArena)
+            , previous_(current())
+        {
+            current() = arena_;
+        }
+        ~Scope()
+        {
+            current() = previous_;
+            arena_->release();
+        }
+
+        // The bytes the arena took so far
+        size_t bytes() const { return arena_->filled_; }
+
+    private:
+        StateArena * arena_;
+        StateArena * previous_;
+    };
+
+    // The arena being filled on the calling thread, if any
+    static StateArena *& current()
+    {
+        static thread_local StateArena * arena = nullptr;
+        return arena;
+    }
+
+    void retain() noexcept
+    {
+        refs_.fetch_add(1, std::memory_order_relaxed);
+    }
+    void release() noexcept
+    {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            delete this;
+        }
+    }
+
+    void * allocate(size_t bytes, size_t alignment)
+    {
+        size_t offset = (used_ + alignment - 1) / alignment * alignment;
+        if (chunks_.empty() || offset + bytes > chunks_.back().capacity())
+        {
+            // the first chunk is as large as the largest chain seen so far, so that after the first file
+            //  a chain takes a single one
+            chunks_.emplace_back(std::max({ bytes, filled_, largest().load(std::memory_order_relaxed), MinChunk }));
+            used_ = offset = 0;
+        }
+        // what a single chunk would take for everything so far
+        filled_ = (filled_ + alignment - 1) / alignment * alignment + bytes;
+        used_ = offset + bytes;
+        return chunks_.back().data() + offset;
+    }
+
+    bool owns(const void * p) const noexcept
+    {
+        for (auto & chunk : chunks_)
+        {
+            if (p >= chunk.data() && p < chunk.data() + chunk.capacity())
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Filter objects keep the arena they are in (or none) in a cache line before them, their delete finds it there
+    static void * allocateObject(size_t size)
+    {
+        StateArena * arena = current();
+        uint8_t * p;
+        if (arena)
+        {
+            p = (uint8_t *)arena->allocate(ObjectHeader + size, AlignedBuffer::Alignment);
+            arena->retain();
+        }
+        else
+        {
+            p = (uint8_t *)::operator new(ObjectHeader + size, std::align_val_t(AlignedBuffer::Alignment));
+        }
+        *(StateArena **)p = arena;
+        return p + ObjectHeader;
+    }
+    static void deallocateObject(void * object) noexcept
+    {
+        if (!object)
+        {
+            return;
+        }
+        uint8_t * p = (uint8_t *)object - ObjectHeader;
+        if (StateArena * arena = *(StateArena **)p)
+        {
+            arena->release();
+        }
+        else
+        {
+            ::operator delete(p, std::align_val_t(AlignedBuffer::Alignment));
+        }
+    }
+
+private:
+    static constexpr size_t MinChunk = 4096;
+    static constexpr size_t ObjectHeader = AlignedBuffer::Alignment;
+
+    StateArena() = default;
+    ~StateArena()
+    {
+        auto & largest = StateArena::largest();
+        size_t seen = largest.load(std::memory_order_relaxed);
+        while (filled_ > seen && !largest.compare_exchange_weak(seen, filled_, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    static std::atomic<size_t> & largest()
+    {
+        static std::atomic<size_t> bytes { 0 };
+        return bytes;
+    }
+
+    // the scope holds one reference until it closes
+    std::atomic<int>            refs_ { 1 };
+    std::vector<AlignedBuffer>  chunks_;
+    size_t                      used_ = 0;
+    size_t                      filled_ = 0;
+};
+
+
+// Allocates in the arena being filled on the calling thread when it was made in it, on the heap otherwise
+template<typename T>
+class StateAllocator
+{
+public:
+    using value_type = T;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    StateAllocator() noexcept
+        : StateAllocator(StateArena::current())
+    {}
+    StateAllocator(const StateAllocator & other) noexcept
+        : StateAllocator(other.arena_)
+    {}
+    template<typename U>
+    StateAllocator(const StateAllocator<U> & other) noexcept
+        : StateAllocator(other.arena())
+    {}
+    StateAllocator & operator=(const StateAllocator & other) noexcept
+    {
+        if (other.arena_)
+        {
+            other.arena_->retain();
+        }
+        if (arena_)
+        {
+            arena_->release();
+        }
+        arena_ = other.arena_;
+        return *this;
+    }
+    ~StateAllocator()
+    {
+        if (arena_)
+        {
+            arena_->release();
+        }
+    }
+
+    T * allocate(size_t n)
+    {
+        if (arena_ && arena_ == StateArena::current())
+        {
+            return (T *)arena_->allocate(n * sizeof(T), alignof(T));
+        }
+        return (T *)::operator new(n * sizeof(T));
+    }
+    void deallocate(T * p, size_t) noexcept
+    {
+        if (!arena_ || !arena_->owns(p))
+        {
+            ::operator delete(p);
+        }
+    }
+
+    // a copy of a chain's buffer made later is not a part of the chain
+    StateAllocator select_on_container_copy_construction() const
+    {
+        return StateAllocator();
+    }
+
+    StateArena * arena() const noexcept { return arena_; }
+
+    template<typename U>
+    bool operator==(const StateAllocator<U> & other) const noexcept { return arena_ == other.arena(); }
+    template<typename U>
+    bool operator!=(const StateAllocator<U> & other) const noexcept { return arena_ != other.arena(); }
+
+private:
+    explicit StateAllocator(StateArena * arena) noexcept
+        : arena_(arena)
+    {
+        if (arena_)
+        {
+            arena_->retain();
+        }
+    }
+
+    StateArena * arena_;
+};
+
+// The containers of the filter states
+template<typename T>
+using StateBuffer = boost::circular_buffer<T, StateAllocator<T>>;
+template<typename T>
+using StateVector = std::vector<T, StateAllocator<T>>;
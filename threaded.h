@@ -6,124 +6,447 @@
 #include <mutex>
 #include <atomic>
 #include <condition_variable>
+#include <exception>
+#include <deque>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <map>
+#include <limits>
+#include <memory>
 
 #include "log.hpp"
 
-// <arguments_list, class object> for threading
-// The class object's object::operator() should be overloaded to call it like (object)(arguments_list) for each thread
-template<typename Workitem, typename Worker> 
-class ThreadedWorker
+
+// A fixed set of worker threads running tasks. Each worker has its own deque: the tasks a worker submits go to its
+// own deque and it takes them from the front, in the order they were made; the tasks submitted from other threads
+// are taken in order from a shared queue next, and a worker without either steals from the back of the others.
+// Tasks may submit and wait for other tasks (the segments of a file). A worker waiting for them runs only the
+// tasks of its own deque meanwhile, the ones it submitted, so that it never starts an unrelated job (a whole
+// file) on top of the one it waits in; the idle workers steal the rest. A task must not block on anything
+// else that only another queued task would release.
+// The workers above the active count are parked: they finish what they run but take no new work, except for
+// the tasks they submitted and wait for
+class WorkPool
 {
-    ThreadedWorker(const ThreadedWorker &) = delete;
-    ThreadedWorker operator=(const ThreadedWorker &) = delete;
+    WorkPool(const WorkPool &) = delete;
+    WorkPool operator=(const WorkPool &) = delete;
 public:
-    ThreadedWorker(const std::vector<Workitem> & items, std::unique_ptr<Worker> & worker, int maxThreads = 0)
-        : items_(items)
-        , worker_(std::move(worker))
+    explicit WorkPool(int threads, int active = 0)
+        : queues_(std::max(1, threads))
+        , active_(active > 0 ? std::min(active, int(queues_.size())) : int(queues_.size()))
     {
-        maxThreads_ = maxThreads > 0 ? maxThreads : std::thread::hardware_concurrency();
-        msg() << "Using " << maxThreads_ << " CPU threads...";
-        for (int i = 0; i < maxThreads_; i++)
-        {	// create a new thread, passing: (threading function address, this scope's address, custom argument);
-            threads_.push_back(std::thread(&ThreadedWorker::threadRun, this, i));
+        for (int i = 0; i < int(queues_.size()); i++)
+        {
+            threads_.push_back(std::thread([this, i] ()
+                                           {
+                                               worker() = { this, i };
+                                               help([this] { return stop_ && queued_ == 0; }, true);
+                                           }));
         }
     }
 
-    ~ThreadedWorker()
+    // The queued tasks are run before the threads exit
+    ~WorkPool()
     {
         {
-            std::unique_lock lock(sleeping_mtx_);
-            terminate_ = true;
+            std::lock_guard lock(sleepMtx_);
+            stop_ = true;
         }
-        sleeping_.notify_all();
+        wake_.notify_all();
         for (auto & thread : threads_)
         {
-            //if (thread.joinable())
-                thread.join();
+            thread.join();
         }
     }
 
-    void waitForDone()
+    int size() const { return int(threads_.size()); }
+
+    // The number of workers taking new tasks, 1 to size()
+    int active() const { return active_; }
+    void setActive(int active)
     {
-        if (items_.empty())
+        active_ = std::clamp(active, 1, size());
+        notify();
+    }
+
+    // The pool whose worker is the calling thread, null on other threads
+    static WorkPool * current() { return worker().pool; }
+    // The index of the calling worker thread in its pool
+    static int currentIndex() { return worker().index; }
+
+    void submit(std::function<void()> task)
+    {
+        submit(std::move(task), current() == this ? worker().index : -1);
+    }
+    // To the deque of the worker at index as if that worker had submitted it, -1 for the shared queue
+    void submit(std::function<void()> task, int index)
+    {
+        auto & queue = index >= 0 ? queues_[index] : injected_;
         {
-            return;
+            std::lock_guard lock(queue.mtx);
+            queue.tasks.push_back(std::move(task));
         }
+        queued_++;
+        // all of them, the one woken up could be a thread that only waits
+        notify();
+    }
 
-        do
+    // Returns once done() is true. A worker of the pool runs the tasks of its own deque meanwhile, any other
+    // thread sleeps. idle is the loop of a worker between tasks, which takes any task; a parked worker only
+    // sleeps there
+    template<typename Done>
+    void help(Done && done, bool idle = false)
+    {
+        const bool isWorker = current() == this;
+        auto runs = [&] { return isWorker && (!idle || worker().index < active_); };
+        // a task submitted to the deque of a sleeping worker wakes it up, submit() notifies under sleepMtx_
+        auto hasWork = [&] { return idle ? queued_ > 0 : !ownQueueEmpty(); };
+        while (!done())
         {
+            if (runs() && runOne(idle))
             {
-                std::lock_guard lock(mtx_);
-                if (inputIdx_ >= items_.size())
-                {
-                    return;
-                }
+                continue;
             }
-            std::this_thread::sleep_for(std::chrono::milliseconds(500));
-        } while (true);
+
+            std::unique_lock lock(sleepMtx_);
+            if (done() || (runs() && hasWork()))
+            {
+                continue;
+            }
+            wake_.wait(lock);
+        }
     }
 
+    // Wakes the threads waiting in help() to check their condition again
+    void notify()
+    {
+        {
+            std::lock_guard lock(sleepMtx_);
+        }
+        wake_.notify_all();
+    }
 
 private:
-    bool next(Workitem & item)
+    struct alignas(64) Queue
     {
-        std::lock_guard lock(mtx_);
+        std::mutex                          mtx;
+        std::deque<std::function<void()>>   tasks;
+    };
+
+    struct Worker
+    {
+        WorkPool *  pool = nullptr;
+        int         index = 0;
+    };
+
+    static Worker & worker()
+    {
+        static thread_local Worker w;
+        return w;
+    }
+
+    bool ownQueueEmpty()
+    {
+        auto & queue = queues_[worker().index];
+        std::lock_guard lock(queue.mtx);
+        return queue.tasks.empty();
+    }
 
-        if (inputIdx_ >= items_.size())
+    // any is false while the worker waits in a task, it takes from its own deque only then
+    bool runOne(bool any)
+    {
+        std::function<void()> task;
+        auto take = [&task] (Queue & queue, bool front)
+        {
+            std::lock_guard lock(queue.mtx);
+            if (queue.tasks.empty())
+            {
+                return false;
+            }
+            task = std::move(front ? queue.tasks.front() : queue.tasks.back());
+            front ? queue.tasks.pop_front() : queue.tasks.pop_back();
+            return true;
+        };
+
+        const size_t own = size_t(worker().index);
+        bool found = take(queues_[own], true) || (any && take(injected_, true));
+        for (size_t k = 1; k < queues_.size() && any && !found; k++)
+        {
+            found = take(queues_[(own + k) % queues_.size()], false);
+        }
+        if (!found)
         {
             return false;
         }
-
-        item = items_[inputIdx_++];
+        queued_--;
+        task();
         return true;
     }
 
-    void threadRun(int threadIndex)
+    std::vector<Queue>          queues_;
+    std::vector<std::thread>    threads_;
+    // the tasks submitted from outside the pool, taken in order
+    Queue                       injected_;
+    std::atomic<int>            queued_ = 0;
+    std::atomic<int>            active_;
+    std::atomic_bool            stop_ = false;
+
+    std::mutex                  sleepMtx_;
+    std::condition_variable     wake_;
+};
+
+
+// Tasks that are waited for together. wait() returns when all of them have finished and rethrows the first
+// exception any of them threw. The tasks go to the deque of the worker that made the group, wherever they are
+// run from, so that it runs them while it waits. Without a pool the tasks run right away on the calling thread
+class TaskGroup
+{
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup operator=(const TaskGroup &) = delete;
+public:
+    explicit TaskGroup(WorkPool * pool = WorkPool::current())
+        : pool_(pool)
+        , owner_(pool && pool == WorkPool::current() ? WorkPool::currentIndex() : -1)
+    {}
+
+    ~TaskGroup()
+    {
+        join();
+    }
+
+    template<typename Fn>
+    void run(Fn && fn)
+    {
+        if (!pool_)
+        {
+            execute(fn);
+            return;
+        }
+        pending_++;
+        pool_->submit([this, pool = pool_, fn = std::forward<Fn>(fn)] () mutable
+                      {
+                          execute(fn);
+                          // the group may be gone as soon as it is done
+                          if (--pending_ == 0)
+                          {
+                              pool->notify();
+                          }
+                      }, owner_);
+    }
+
+    void wait()
+    {
+        join();
+        if (error_)
+        {
+            std::rethrow_exception(std::exchange(error_, nullptr));
+        }
+    }
+
+    bool done() const { return pending_ == 0; }
+
+private:
+    template<typename Fn>
+    void execute(Fn & fn)
     {
-        while (!terminate_)
+        try
         {
-            Workitem item;
-            if (next(item))
+            fn();
+        }
+        catch (...)
+        {
+            std::lock_guard lock(mtx_);
+            if (!error_)
             {
-                auto r = (*worker_)(item);
-                {
-                    std::lock_guard lock(runMtx_);
-                #if defined(_WIN32)
-                        wmsg() << L"[CPU " << threadIndex + 1 << L"] " << ++runIdx_ << L'/' << items_.size() << L"  " << r;
-                #else
-                        msg() << "[CPU " << threadIndex + 1 << "] " << ++runIdx_ << '/' << items_.size() << "  " << r;
-                #endif
-                }
-
-                // more work to do
-                continue;
+                error_ = std::current_exception();
             }
+        }
+    }
+
+    void join()
+    {
+        if (pool_)
+        {
+            pool_->help([this] { return done(); });
+        }
+    }
+
+    WorkPool *          pool_;
+    // the worker that made the group, -1 for a thread outside the pool
+    int                 owner_;
+    std::atomic<int>    pending_ = 0;
+    std::mutex          mtx_;
+    std::exception_ptr  error_;
+};
+
+
+// The stages of one job (decode, filter, encode) as tasks of a group, so that they run on the pool's workers
+// instead of threads of their own. A stage's step takes what it can without waiting and returns, schedule()
+// is called whenever the stage may have new work. The step of a stage never runs twice at a time, and a
+// schedule() that comes while it runs makes it run once more, so no work handed to it is missed.
+// The first exception thrown by any step raises abort, so that the other stages stop taking work, and is
+// rethrown by join()
+class StageTasks
+{
+    StageTasks(const StageTasks &) = delete;
+    StageTasks operator=(const StageTasks &) = delete;
+public:
+    explicit StageTasks(WorkPool * pool = WorkPool::current())
+        : group_(pool)
+    {}
+
+    // Adds a stage, they are numbered from 0 in the order they are added
+    template<typename Fn>
+    void add(Fn && step)
+    {
+        stages_.emplace_back().step = std::forward<Fn>(step);
+    }
+
+    void schedule(size_t stage)
+    {
+        auto & s = stages_[stage];
+        if (s.requests.fetch_add(1, std::memory_order_acq_rel) == 0)
+        {
+            group_.run([this, &s] { run(s); });
+        }
+    }
+
+    void join()
+    {
+        group_.wait();
+    }
+
+    std::atomic_bool            abort = false;
+
+private:
+    struct Stage
+    {
+        std::function<void()>   step;
+        std::atomic<int>        requests = 0;
+    };
 
-            // no work, sleep
+    // the requests that came until the step started are served by it, the later ones by another round
+    void run(Stage & s)
+    {
+        int requests = s.requests.load(std::memory_order_acquire);
+        while (true)
+        {
+            try
             {
-                std::unique_lock lock(sleeping_mtx_);
-                if (terminate_)
-                {
-                    break;
-                }
-                sleeping_.wait(lock);
+                s.step();
+            }
+            catch (...)
+            {
+                // the stage is not run again, its requests stay
+                abort = true;
+                throw;
+            }
+            requests = s.requests.fetch_sub(requests, std::memory_order_acq_rel) - requests;
+            if (requests == 0)
+            {
+                return;
             }
         }
     }
 
+    std::deque<Stage>           stages_;
+    // the last member: it waits for the tasks still running before the stages go
+    TaskGroup                   group_;
+};
 
-    int maxThreads_;
-    std::vector<std::thread>    threads_;
-    std::condition_variable     sleeping_;
-    std::mutex                  sleeping_mtx_;
-    std::atomic_bool            terminate_ = false;
 
-    std::mutex                  mtx_;
-    std::vector<Workitem>       items_;
-    int                         inputIdx_ = 0;
+// <arguments_list, class object> for threading
+// The class object's object::operator() should be overloaded to call it like (object)(arguments_list) for each thread.
+// The items are the tasks of a WorkPool, which the worker can use for parallel work inside an item.
+// Items may be added while the others run. Each task takes the waiting item of the highest priority when it
+// starts, the first added of equal ones; with interleave the tasks take the highest and the lowest in turn
+template<typename Workitem, typename Worker> 
+class ThreadedWorker
+{
+    ThreadedWorker(const ThreadedWorker &) = delete;
+    ThreadedWorker operator=(const ThreadedWorker &) = delete;
+public:
+    // activeThreads of the maxThreads take work at first, see WorkPool::setActive
+    ThreadedWorker(std::unique_ptr<Worker> & worker, int maxThreads = 0, int activeThreads = 0, bool interleave = false)
+        : worker_(std::move(worker))
+        , interleave_(interleave)
+        , pool_(maxThreads > 0 ? maxThreads : int(std::thread::hardware_concurrency()), activeThreads)
+        , items_(&pool_)
+    {
+        if (pool_.active() < pool_.size())
+        {
+            msg() << "Using " << pool_.active() << " of up to " << pool_.size() << " CPU threads...";
+        }
+        else
+        {
+            msg() << "Using " << pool_.size() << " CPU threads...";
+        }
+    }
+
+    void add(Workitem item, double priority = 0)
+    {
+        {
+            std::lock_guard lock(mtx_);
+            waiting_.emplace(std::make_pair(priority, -added_), std::move(item));
+            added_++;
+        }
+        items_.run([this] ()
+                   {
+                       Workitem item = take();
+                       auto r = (*worker_)(item);
+                       // the count of items goes up while they are being added
+                       const char * more = closed_ ? "" : "+";
+                   #if defined(_WIN32)
+                       wmsg() << L"[CPU " << WorkPool::currentIndex() + 1 << L"] " << ++runIdx_ << L'/' << added_ << more << L"  " << r;
+                   #else
+                       msg() << "[CPU " << WorkPool::currentIndex() + 1 << "] " << ++runIdx_ << '/' << added_ << more << "  " << r;
+                   #endif
+                   });
+    }
 
-    std::mutex                  runMtx_;
-    int                         runIdx_ = 0;
+    // No more items will be added
+    void close()
+    {
+        closed_ = true;
+    }
+
+    // Returns when every item is finished, the items are all added by then
+    void waitForDone()
+    {
+        items_.wait();
+    }
+
+    bool done() const { return items_.done(); }
+
+    WorkPool & pool() { return pool_; }
+
+private:
+    Workitem take()
+    {
+        std::lock_guard lock(mtx_);
+        auto it = std::prev(waiting_.end());
+        if (interleave_ && (taken_++ % 2))
+        {
+            // the first added of the lowest
+            it = std::prev(waiting_.lower_bound({ waiting_.begin()->first.first, std::numeric_limits<int64_t>::max() }));
+        }
+        Workitem item = std::move(it->second);
+        waiting_.erase(it);
+        return item;
+    }
 
     std::unique_ptr<Worker>     worker_;
+    std::atomic<int>            runIdx_ = 0;
+    const bool                  interleave_;
+
+    // by priority, then the order they were added in
+    std::mutex                  mtx_;
+    std::multimap<std::pair<double, int64_t>, Workitem> waiting_;
+    std::atomic<int64_t>        added_ = 0;
+    int64_t                     taken_ = 0;
+    std::atomic_bool            closed_ = false;
+
+    WorkPool                    pool_;
+    TaskGroup                   items_;
 };
@@ -10,6 +10,12 @@ const fs = require('fs');
 const { execSync } = require('child_process');
 const UPLOAD_PATH = './public/uploads';
 const CONVERTER_PATH = '../star_echo';
+// rendered songs by their content, shared with the command line runs that use the same directory
+const CACHE_PATH = process.env.STAR_ECHO_CACHE || '../render-cache';
+// the least recently used renders go above this size
+const CACHE_SIZE = process.env.STAR_ECHO_CACHE_SIZE || '10G';
+// the decoded uploads, each is rendered with several filters
+const PCM_CACHE_PATH = '../pcm-cache';
 const VOLUME_MATCHER_PATH = 'python3 ../volume-matcher.py';
 const argparse = require('argparse');
 
@@ -128,7 +134,7 @@ app.post('/', upload.single('pic'), (req,res)=>{
 			console.log("CMD0: " + cmd);
 			var stdout = execSync(cmd);
 
-			var cmd = CONVERTER_PATH + ' -n -s 5 -i "public/' + x.replace('"', '\\"') + '" ' + obj.filter +  ' -o "public/' + obj.filename.replace('"', '\\"') + '"';
+			var cmd = CONVERTER_PATH + ' -n -s 5 --cache "' + CACHE_PATH + '" --cache-size ' + CACHE_SIZE + ' --pcm-cache "' + PCM_CACHE_PATH + '" -i "public/' + x.replace('"', '\\"') + '" ' + obj.filter +  ' -o "public/' + obj.filename.replace('"', '\\"') + '"';
 			console.log("CMD1: " + cmd);
 			var stdout = execSync(cmd);
 